@@ -3,7 +3,13 @@
 #ifndef __HPC_AFFINITY_HPP__
 #define __HPC_AFFINITY_HPP__
 
+#include <map>
+#include <set>
+#include <tuple>
+#include <numeric>
+
 #include "cpu.hpp"
+#include "topology.hpp"
 
 namespace hpc {
 
@@ -30,8 +36,37 @@ namespace hpc {
         }
     }
 
-    std::size_t cal_stream_num(int stream_num) {
-        return stream_num != 0 ? stream_num : get_hardware_sockets();
+    // node by node; inside a node one hardware thread per physical core
+    // first, the SMT siblings after all of them. With smt_last == false the
+    // siblings of a core stay next to each other instead.
+    std::vector<int> cal_ordered_cores(std::vector<int> cores, const cpu_topology &topology,
+                                       bool smt_last=true) {
+        auto rank = [&topology, smt_last](int cpu) {
+            auto info = topology.find(cpu);
+            if (info == nullptr) {
+                return std::make_tuple(0, 0, cpu, cpu);
+            } else if (smt_last) {
+                return std::make_tuple(info->node, info->smt_index, info->core, cpu);
+            } else {
+                return std::make_tuple(info->node, info->core, info->smt_index, cpu);
+            }
+        };
+        std::stable_sort(cores.begin(), cores.end(), [&rank](int a, int b) {
+            return rank(a) < rank(b);
+        });
+        return cores;
+    }
+
+    // one stream per NUMA node the usable cores span, unless told otherwise
+    std::size_t cal_stream_num(int stream_num, std::vector<int> &cores, const cpu_topology &topology) {
+        if (stream_num != 0) {
+            return stream_num;
+        }
+        std::set<int> nodes;
+        for (auto core : cores) {
+            nodes.insert(topology.node_of(core));
+        }
+        return std::max<std::size_t>(1, nodes.size());
     }
 
     std::vector<std::vector<int>> cal_thread_affinity(
@@ -89,33 +124,103 @@ namespace hpc {
         return thread_affinity;
     }
 
-    std::vector<std::vector<std::vector<int>>> cal_streams_affinity(
-        int streams, int threads, bool affinity, bool verbose) {
-        auto cores = cal_parallel_cores(affinity);
-        auto cores_num = cores.size();
-        auto thread_num = cal_thread_num(threads, cores_num);
-        auto stream_num = cal_stream_num(streams);
+    // threads of one stream get whole physical cores (all SMT siblings)
+    // while there are enough cores, single hardware threads beyond that
+    std::vector<std::vector<int>> cal_stream_thread_affinity(
+        int thread_num, std::vector<int> &cores, const cpu_topology &topology) {
+        std::vector<std::vector<int>> physical_cores;
+        std::map<int, std::size_t> core_index;
+        for (auto cpu : cores) {
+            auto info = topology.find(cpu);
+            auto core = info != nullptr ? info->core : -1 - cpu;
+            if (core_index.find(core) == core_index.end()) {
+                core_index[core] = physical_cores.size();
+                physical_cores.emplace_back();
+            }
+            physical_cores[core_index[core]].emplace_back(cpu);
+        }
 
-        std::vector<std::vector<int>> thread_affinity =
-            cal_thread_affinity(thread_num, cores);
+        if (thread_num > physical_cores.size()) {
+            return cal_thread_affinity(thread_num, cores);
+        }
 
-        int threads_per_stream = thread_num / stream_num;
-        int threads_tail = thread_num % stream_num;
+        std::vector<int> indices(physical_cores.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        auto thread_cores = cal_thread_affinity(thread_num, indices);
+        std::vector<std::vector<int>> thread_affinity(thread_num);
+        for (auto i = 0; i < thread_num; i++) {
+            for (auto index : thread_cores[i]) {
+                for (auto cpu : physical_cores[index]) {
+                    thread_affinity[i].emplace_back(cpu);
+                }
+            }
+        }
+        return thread_affinity;
+    }
 
-        std::vector<std::vector<std::vector<int>>> streams_affinity;
+    // topology and usable cores are parameters so layouts of other machines
+    // (a fake sysfs tree) can be computed too
+    std::vector<std::vector<std::vector<int>>> cal_streams_affinity(
+        int streams, int threads, std::vector<int> usable_cores,
+        const cpu_topology &topology, bool verbose) {
+        auto cores = cal_ordered_cores(usable_cores, topology, false);
+        auto cores_num = cores.size();
+        auto thread_num = cal_thread_num(threads, cores_num);
+        // a stream without threads would never drain its queue
+        auto stream_num = std::min(cal_stream_num(streams, cores, topology), thread_num);
+
+        // cores of each stream: a NUMA node each when the counts match,
+        // otherwise even slices of the node-ordered core list, which keeps
+        // SMT siblings in the same slice
+        std::vector<int> nodes;
+        for (auto core : cores) {
+            auto node = topology.node_of(core);
+            if (std::find(nodes.begin(), nodes.end(), node) == nodes.end()) {
+                nodes.emplace_back(node);
+            }
+        }
+        std::vector<std::vector<int>> stream_cores(stream_num);
+        if (nodes.size() == stream_num) {
+            for (auto core : cores) {
+                auto node = topology.node_of(core);
+                stream_cores[std::find(nodes.begin(), nodes.end(), node) - nodes.begin()].emplace_back(core);
+            }
+        } else if (stream_num <= cores_num) {
+            for (auto i = 0; i < stream_num; i++) {
+                for (auto j = i * cores_num / stream_num; j < (i + 1) * cores_num / stream_num; j++) {
+                    stream_cores[i].emplace_back(cores[j]);
+                }
+            }
+        } else {
+            for (auto i = 0; i < stream_num; i++) {
+                stream_cores[i].emplace_back(cores[i % cores_num]);
+            }
+        }
 
-        auto thread_idx = 0;
+        // one thread per stream, the rest shared out by each stream's core count
+        std::vector<int> stream_threads(stream_num, 1);
+        auto spare_threads = thread_num - stream_num;
+        auto assigned = 0;
+        // streams may share cores when there are more streams than cores
+        std::size_t stream_cores_num = 0;
+        for (auto &stream : stream_cores) {
+            stream_cores_num += stream.size();
+        }
         for (auto i = 0; i < stream_num; i++) {
-            thread_idx = i * threads_per_stream;
-            std::vector<std::vector<int>> threads_affinity;
-            for (; thread_idx < (i+1)*threads_per_stream; thread_idx++) {
-                threads_affinity.emplace_back(thread_affinity[thread_idx]);
-            }
-            streams_affinity.emplace_back(threads_affinity);
+            auto share = spare_threads * stream_cores[i].size() / stream_cores_num;
+            stream_threads[i] += share;
+            assigned += share;
+        }
+        for (auto i = 0; assigned < spare_threads; i = (i + 1) % stream_num) {
+            stream_threads[i]++;
+            assigned++;
         }
 
-        for (; thread_idx < thread_num; thread_idx++) {
-            streams_affinity[stream_num-1].emplace_back(thread_affinity[thread_idx]);
+        std::vector<std::vector<std::vector<int>>> streams_affinity;
+        for (auto i = 0; i < stream_num; i++) {
+            auto ordered = cal_ordered_cores(stream_cores[i], topology);
+            streams_affinity.emplace_back(
+                cal_stream_thread_affinity(stream_threads[i], ordered, topology));
         }
 
         if (verbose) {
@@ -135,6 +240,12 @@ namespace hpc {
         return streams_affinity;
     }
 
+    std::vector<std::vector<std::vector<int>>> cal_streams_affinity(
+        int streams, int threads, bool affinity, bool verbose) {
+        return cal_streams_affinity(streams, threads, cal_parallel_cores(affinity),
+                                    cpu_topology::local(), verbose);
+    }
+
 }
 
 #endif // __HPC_AFFINITY_HPP__
\ No newline at end of file
@@ -0,0 +1,219 @@
+#pragma once
+
+#ifndef __HPC_ARENA_HPP__
+#define __HPC_ARENA_HPP__
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
+#include <utility>
+#include <type_traits>
+
+#include "cpu.hpp"
+#include "task.hpp"
+
+namespace hpc {
+
+    const std::size_t SLOT_CLASSES = 4;
+    // a pooled_task with its header already takes more than 128B
+    const std::size_t SLOT_MIN_SIZE = 256;
+    // slots per size class a worker preallocates on its own node
+    const std::size_t SLOT_RESERVE = 32;
+
+    class slot_cache;
+
+    // sits in front of every slot handed out by slot_cache
+    class alignas(alignof(std::max_align_t)) slot_header {
+        public:
+            slot_header *next;
+            slot_cache *owner;
+            std::size_t size_class;
+    };
+
+    // Per-thread freelists of fixed size slots (256B .. 2KB). A slot freed by
+    // its owner thread goes straight back on the local list; a slot freed by
+    // another thread is pushed on the owner's lock-free remote list, which
+    // the owner takes over in one exchange when its local list runs dry.
+    // Caches of exited threads are parked and adopted by new threads.
+    class slot_cache {
+        public:
+            static slot_cache &local() {
+                static thread_local handle current;
+                return *current.cache;
+            }
+
+            void *allocate(std::size_t size) {
+                auto size_class = class_of(size + sizeof(slot_header));
+                slot_header *slot = nullptr;
+                if (size_class >= SLOT_CLASSES) {
+                    slot = static_cast<slot_header *>(::operator new(size + sizeof(slot_header)));
+                } else {
+                    if (this->local_free[size_class] == nullptr) {
+                        this->local_free[size_class] = this->remote_free[size_class].exchange(
+                            nullptr, std::memory_order_acquire);
+                    }
+                    slot = this->local_free[size_class];
+                    if (slot != nullptr) {
+                        this->local_free[size_class] = slot->next;
+                    } else {
+                        slot = new_slot(size_class);
+                    }
+                }
+                slot->owner = this;
+                slot->size_class = size_class;
+                return slot + 1;
+            }
+
+            // fills every local freelist up to count slots, allocated and
+            // written here so their pages sit on the calling thread's node
+            void reserve(std::size_t count) {
+                for (std::size_t size_class = 0; size_class < SLOT_CLASSES; size_class++) {
+                    std::size_t length = 0;
+                    for (auto slot = this->local_free[size_class]; slot != nullptr; slot = slot->next) {
+                        length++;
+                    }
+                    for (; length < count; length++) {
+                        auto slot = new_slot(size_class);
+                        std::memset(slot, 0, SLOT_MIN_SIZE << size_class);
+                        slot->next = this->local_free[size_class];
+                        this->local_free[size_class] = slot;
+                    }
+                }
+            }
+
+            static void deallocate(void *ptr) {
+                auto slot = static_cast<slot_header *>(ptr) - 1;
+                if (slot->size_class >= SLOT_CLASSES) {
+                    ::operator delete(slot);
+                    return;
+                }
+                auto owner = slot->owner;
+                if (owner == &local()) {
+                    slot->next = owner->local_free[slot->size_class];
+                    owner->local_free[slot->size_class] = slot;
+                } else {
+                    auto &head = owner->remote_free[slot->size_class];
+                    slot->next = head.load(std::memory_order_relaxed);
+                    while (!head.compare_exchange_weak(
+                        slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {};
+                }
+            }
+
+        private:
+            class handle {
+                public:
+                    handle() {
+                        std::lock_guard<std::mutex> lock(orphans_mutex());
+                        if (orphans().empty()) {
+                            this->cache = new slot_cache();
+                        } else {
+                            this->cache = orphans().back();
+                            orphans().pop_back();
+                        }
+                    }
+
+                    // slots may still be in flight, keep the cache for a later thread
+                    ~handle() {
+                        std::lock_guard<std::mutex> lock(orphans_mutex());
+                        orphans().push_back(this->cache);
+                    }
+
+                    slot_cache *cache;
+            };
+
+            static std::mutex &orphans_mutex() {
+                static std::mutex mt;
+                return mt;
+            }
+
+            static std::vector<slot_cache *> &orphans() {
+                static std::vector<slot_cache *> caches;
+                return caches;
+            }
+
+            // slot sizes are multiples of a cache line, aligned slots never
+            // share one, so two workers running neighbouring tasks do not
+            // contend; slots are recycled but never freed
+            static slot_header *new_slot(std::size_t size_class) {
+                void *memory = nullptr;
+                if (posix_memalign(&memory, CACHE_LINE_SIZE, SLOT_MIN_SIZE << size_class) != 0) {
+                    throw std::bad_alloc();
+                }
+                return static_cast<slot_header *>(memory);
+            }
+
+            static std::size_t class_of(std::size_t size) {
+                std::size_t size_class = 0;
+                while (size_class < SLOT_CLASSES && (SLOT_MIN_SIZE << size_class) < size) {
+                    size_class++;
+                }
+                return size_class;
+            }
+
+            // owner only, kept off the line other threads CAS remote_free on
+            slot_header *local_free[SLOT_CLASSES] = {};
+            char pad0[CACHE_LINE_SIZE];
+            std::atomic<slot_header *> remote_free[SLOT_CLASSES] = {};
+            char pad1[CACHE_LINE_SIZE];
+    };
+
+    // fire-and-forget task whose callable lives in the same pooled slot,
+    // no shared_ptr and no per-task malloc once the caches are warm
+    class pooled_task : public task_base {
+        public:
+            template <typename F>
+            static pooled_task *create(F &&fn) {
+                using callable = typename std::decay<F>::type;
+                static_assert(alignof(callable) <= alignof(std::max_align_t),
+                              "over-aligned callables are not supported");
+                auto memory = slot_cache::local().allocate(storage_offset() + sizeof(callable));
+                auto task = new (memory) pooled_task();
+                try {
+                    new (task->storage()) callable(std::forward<F>(fn));
+                } catch (...) {
+                    // a throwing copy or move of the callable, hand the slot back
+                    task->~pooled_task();
+                    slot_cache::deallocate(memory);
+                    throw;
+                }
+                task->invoke = [](void *fn) { (*static_cast<callable *>(fn))(); };
+                task->destroy = [](void *fn) { static_cast<callable *>(fn)->~callable(); };
+                return task;
+            }
+
+            void process() {
+                this->invoke(this->storage());
+            }
+
+            void recycle() {
+                this->destroy(this->storage());
+                this->~pooled_task();
+                slot_cache::deallocate(this);
+            }
+
+        private:
+            pooled_task() = default;
+
+            static constexpr std::size_t storage_offset() {
+                return (sizeof(pooled_task) + alignof(std::max_align_t) - 1)
+                     / alignof(std::max_align_t) * alignof(std::max_align_t);
+            }
+
+            void *storage() {
+                return reinterpret_cast<char *>(this) + storage_offset();
+            }
+
+            void (*invoke)(void *);
+            void (*destroy)(void *);
+    };
+
+    static_assert(sizeof(pooled_task) + sizeof(slot_header) <= SLOT_MIN_SIZE,
+                  "the smallest slot class must hold a pooled_task");
+
+}
+
+#endif // __HPC_ARENA_HPP__
@@ -1,5 +1,6 @@
 rm -rf *.out
 
-g++ -std=c++14 -pthread main.cpp -g -o main.out
+# CXXSTD=c++20 ./build_and_run.sh for a build that can use coroutine.hpp
+g++ -std=${CXXSTD:-c++14} -O2 -pthread main.cpp -g -o main.out
 
-./main.out
+./main.out "$@"
@@ -5,20 +5,271 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <queue>
+#include <stdexcept>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <thread>
 #include <condition_variable>
 
+#include "deque.hpp"
+#include "event.hpp"
+#include "ring.hpp"
+#include "stats.hpp"
+#include "task.hpp"
+#include "tenant.hpp"
+#include "trace.hpp"
+
 namespace hpc {
 
+    // upper bound for thread_config::pop_batch
+    const std::size_t MAX_POP_BATCH = 64;
+
+    // heap entries a priority stream preallocates (and touches) up front
+    const std::size_t PRIORITY_HEAP_RESERVE = 1024;
+
+    // how thread_pool::async() picks a stream when none is given
+    enum class dispatch_policy {
+        round_robin,
+        least_loaded,
+    };
+
+    // how the workers of a stream find their next task
+    enum class schedule_policy {
+        fifo,           // every worker pops the shared stream queue
+        work_stealing,  // per-worker deques, idle workers steal from siblings
+        priority,       // highest priority first, then earliest deadline, then fifo
+    };
+
+    // what a worker does with a task whose deadline has already passed
+    enum class expiry_policy {
+        drop,  // complete it as dropped without running it
+        flag,  // run it anyway with task_base::expired set
+    };
+
+    // how thread_pool::sync() runs a task
+    enum class sync_policy {
+        direct,    // task->run() on the caller, bypassing the pool and its accounting
+        queued,    // queued like async(), the caller helps with queued tasks meanwhile
+        adaptive,  // inline on a worker, handed to a parked worker of an idle
+                   // stream, otherwise queued
+    };
+
+    // what async() does when the target stream queue is full
+    enum class overflow_policy {
+        block,        // wait for a free slot
+        reject,       // throw queue_full
+        caller_runs,  // run the task on the submitting thread
+        drop_oldest,  // drop the oldest (least urgent) queued task to make room
+    };
+
+    class queue_full : public std::runtime_error {
+        public:
+            queue_full() : std::runtime_error("stream queue is full") {}
+    };
+
+    class thread_config {
+        public:
+            int stream_num = 0;
+            int thread_num = 0;
+            bool affinity = true;
+            bool verbose = false;
+            dispatch_policy dispatch = dispatch_policy::round_robin;
+            schedule_policy schedule = schedule_policy::fifo;
+            // slots per stream queue, rounded up to a power of two
+            std::size_t capacity = 16384;
+            overflow_policy overflow = overflow_policy::block;
+            expiry_policy expiry = expiry_policy::drop;
+            // an idle worker polls with pause up to idle_spin times, then
+            // yields up to idle_yield times, then parks on a futex. The spin
+            // budget adapts below idle_spin: it grows when spinning found
+            // work and halves after every park.
+            int idle_spin = 1024;
+            int idle_yield = 8;
+            // tasks a worker may take from its stream queue in one CAS, the
+            // extra ones wait on its own deque; never more than a fair share
+            // of the queue. Only under schedule_policy::work_stealing, where
+            // siblings can steal the extra ones back
+            std::size_t pop_batch = 8;
+            // record a timeline per worker for thread_pool::dump_trace()
+            bool trace = false;
+            // events kept per worker, the oldest are overwritten
+            std::size_t trace_capacity = 65536;
+            // upper bounds for thread_pool::resize(), 0 keeps the initial size.
+            // Queues for max_stream_num streams are allocated up front.
+            int max_stream_num = 0;
+            int max_thread_num = 0;
+            // grow the pool while queues stay deep, retire idle workers off-peak
+            bool autoscale = false;
+            int min_thread_num = 1;
+            // sampling period of the auto-scaler
+            double autoscale_interval = 100;
+            // queued tasks per thread that count as a busy sample
+            std::size_t autoscale_depth = 4;
+            // consecutive busy samples before adding threads
+            int autoscale_grow = 2;
+            // consecutive samples with empty queues and a parked worker
+            // before one thread is retired
+            int autoscale_shrink = 50;
+            // resolution of async_after(), async_at() and async_every()
+            double timer_tick = 1;
+    };
+
+    // state private to one worker thread, only reachable by other workers to
+    // steal; the deque pads its top end, the trailing pad keeps the owner's
+    // fields off the next allocation
+    class worker_context {
+        public:
+            work_stealing_deque<task_base *> deque;
+            worker_stats stats;
+            // current spin budget, see thread_config::idle_spin
+            int spin_budget = 0;
+            // nullptr unless thread_config::trace is set
+            std::unique_ptr<trace_buffer> trace;
+            // set by thread_pool::resize() to let this worker exit
+            std::atomic<bool> retire{false};
+            // thread_context::affinity_epoch the worker is pinned for
+            int affinity_epoch = -1;
+            const void *pool = nullptr;
+            int stream_id = 0;
+            int thread_id = 0;
+            char pad[CACHE_LINE_SIZE];
+    };
+
+    // worker the calling thread is, nullptr for threads outside any pool
+    worker_context *&current_worker() {
+        static thread_local worker_context *worker = nullptr;
+        return worker;
+    }
+
+    // heap entry, keys are copied out of the task to keep sifting local
+    class queued_task {
+        public:
+            task_base *task;
+            int priority;
+            std::chrono::steady_clock::time_point deadline;
+            std::uint64_t sequence;
+    };
+
+    // std::push_heap comparator, the most urgent task ends up on top
+    class less_urgent {
+        public:
+            bool operator()(const queued_task &a, const queued_task &b) const {
+                if (a.priority != b.priority) {
+                    return a.priority < b.priority;
+                } else if (a.deadline != b.deadline) {
+                    return a.deadline > b.deadline;
+                } else {
+                    return a.sequence > b.sequence;
+                }
+            }
+    };
+
+    // queue owned by a single stream, only its own workers wait on it.
+    // mt and space are only used to park producers on a full queue.
     template <typename T>
-    class thread_context {
+    class stream_context {
         public:
-            std::vector<std::vector<std::vector<int>>> affinity_infos;
-            std::queue<std::shared_ptr<T>> queue;
-            std::condition_variable condition;
+            stream_context(std::size_t capacity, bool prioritized)
+                : queue(prioritized ? 2 : capacity), capacity(queue.capacity()),
+                  prioritized(prioritized) {
+                if (prioritized) {
+                    this->capacity = capacity;
+                    // resize rather than reserve, so the storage is written here
+                    this->heap.resize(std::min<std::size_t>(capacity, PRIORITY_HEAP_RESERVE));
+                    this->heap.clear();
+                }
+            }
+
+            // pads its own head and tail
+            mpmc_ring<task_base *> queue;
+            // read-mostly from here to the first pad
+            std::size_t capacity;
+            // schedule_policy::priority keeps a heap instead of the ring
+            bool prioritized;
+            // sized for the pool's max_thread_num, only the first
+            // worker_count() entries exist; they are never freed while the
+            // pool lives, retired workers are reused when the stream grows
+            std::vector<std::unique_ptr<worker_context>> workers;
+            std::atomic<std::size_t> worker_num{0};
+            char pad0[CACHE_LINE_SIZE];
+            // written on every push and pop under schedule_policy::priority
+            std::mutex heap_mt;
+            std::vector<queued_task> heap;
+            std::atomic<std::size_t> heap_size{0};
+            std::uint64_t heap_sequence = 0;
+            char pad1[CACHE_LINE_SIZE];
+            // queued plus running tasks accounted to this stream, written by
+            // producers and workers for every task
+            inflight_counter inflight;
+            char pad2[CACHE_LINE_SIZE];
+            // parked workers of this stream
+            eventcount idle;
+            // producers parked on a full queue
+            std::atomic<int> blocked{0};
+            // task thread_pool::sync() passed to a parked worker, bypassing the queue
+            std::atomic<task_base *> handoff{nullptr};
+            char pad3[CACHE_LINE_SIZE];
+            // slow paths only
             std::mutex mt;
+            std::condition_variable space;
+            // tasks of this stream run by threads that are not its workers
+            worker_stats external{true};
+            char pad4[CACHE_LINE_SIZE];
+
+            std::size_t worker_count() const {
+                return this->worker_num.load(std::memory_order_acquire);
+            }
+    };
+
+    template <typename T>
+    // read-mostly settings first, read by every worker for every task; the
+    // two counters written per task get a cache line each
+    class thread_context {
+        public:
+            // bumped whenever affinity_infos changes, workers re-pin themselves
+            std::atomic<int> affinity_epoch{0};
+            // allocated for max_stream_num streams and never resized
+            std::vector<std::shared_ptr<stream_context<T>>> stream_contexts;
+            // streams that take new work, the first stream_num of stream_contexts
+            std::atomic<std::size_t> stream_num{0};
+            std::size_t max_thread_num;
+            bool affinity;
+            // indexed by cpu: the stream owning that core, else a stream on
+            // the same NUMA node, else -1; rebuilt on resize
+            std::vector<std::atomic<int>> core_streams = std::vector<std::atomic<int>>(MAX_THREADS);
+            dispatch_policy dispatch;
+            schedule_policy schedule;
+            std::size_t capacity;
+            overflow_policy overflow;
+            expiry_policy expiry;
+            int idle_spin;
+            int idle_yield;
+            std::size_t pop_batch;
+            bool trace;
+            std::size_t trace_capacity;
+            // trace_now() when the pool started, trace timestamps count from here
+            std::uint64_t trace_epoch;
             bool verbose;
+            // cores of every thread of every stream, guarded by affinity_mt;
+            // streams past stream_num have no threads
+            std::vector<std::vector<std::vector<int>>> affinity_infos;
+            std::mutex affinity_mt;
+            char pad0[CACHE_LINE_SIZE];
+            // round robin cursor of select_stream(), bumped by producers
+            std::atomic<std::size_t> next_stream{0};
+            char pad1[CACHE_LINE_SIZE];
+            // queued plus running tasks of the whole pool
+            inflight_counter inflight;
+            // tasks whose process() threw, only written when one does
+            std::atomic<std::uint64_t> failed{0};
+            char pad2[CACHE_LINE_SIZE];
+            // tenant queues, served by the workers of every stream
+            fair_scheduler tenants;
+            char pad3[CACHE_LINE_SIZE];
     };
 
 }
@@ -0,0 +1,354 @@
+#pragma once
+
+#ifndef __HPC_COROUTINE_HPP__
+#define __HPC_COROUTINE_HPP__
+
+// C++20 coroutines on top of the pool, needs -std=c++20; the rest of the
+// library still builds as C++14
+#if !defined(__cpp_impl_coroutine)
+#error "coroutine.hpp needs C++20 coroutines, build with -std=c++20"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "event.hpp"
+#include "task.hpp"
+#include "threadpool.hpp"
+
+namespace hpc {
+
+    template <typename R = void>
+    class task;
+
+    namespace detail {
+
+        // final_suspend of a task: hands the thread straight to the awaiter
+        class final_awaiter {
+            public:
+                bool await_ready() const noexcept {
+                    return false;
+                }
+
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                    auto continuation = handle.promise().continuation;
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+        };
+
+        class promise_base {
+            public:
+                std::suspend_always initial_suspend() noexcept {
+                    return {};
+                }
+
+                final_awaiter final_suspend() noexcept {
+                    return {};
+                }
+
+                void unhandled_exception() noexcept {
+                    this->error = std::current_exception();
+                }
+
+                std::coroutine_handle<> continuation;
+                std::exception_ptr error;
+        };
+
+        template <typename R>
+        class task_promise : public promise_base {
+            public:
+                task<R> get_return_object() noexcept;
+
+                template <typename V>
+                void return_value(V &&value) {
+                    this->value.emplace(std::forward<V>(value));
+                }
+
+                R result() {
+                    if (this->error) {
+                        std::rethrow_exception(this->error);
+                    }
+                    return std::move(*this->value);
+                }
+
+                std::optional<R> value;
+        };
+
+        template <>
+        class task_promise<void> : public promise_base {
+            public:
+                task<void> get_return_object() noexcept;
+
+                void return_void() noexcept {}
+
+                void result() {
+                    if (this->error) {
+                        std::rethrow_exception(this->error);
+                    }
+                }
+        };
+
+    }
+
+    // Lazy coroutine: the body starts when the task is awaited and the
+    // awaiter is resumed by whichever thread finishes the body, a pool
+    // worker once the body went through co_await pool.schedule(). Nothing
+    // blocks a thread while the task is suspended.
+    template <typename R>
+    class task {
+        public:
+            using promise_type = detail::task_promise<R>;
+
+            explicit task(std::coroutine_handle<promise_type> handle) noexcept : handle(handle) {}
+
+            task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+            task &operator=(task &&other) noexcept {
+                if (this != &other) {
+                    if (this->handle) {
+                        this->handle.destroy();
+                    }
+                    this->handle = std::exchange(other.handle, nullptr);
+                }
+                return *this;
+            }
+
+            task(const task &) = delete;
+            task &operator=(const task &) = delete;
+
+            ~task() {
+                if (this->handle) {
+                    this->handle.destroy();
+                }
+            }
+
+            bool await_ready() const noexcept {
+                return !this->handle || this->handle.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+                this->handle.promise().continuation = awaiter;
+                return this->handle;
+            }
+
+            R await_resume() {
+                return this->handle.promise().result();
+            }
+
+        private:
+            std::coroutine_handle<promise_type> handle;
+    };
+
+    namespace detail {
+
+        template <typename R>
+        task<R> task_promise<R>::get_return_object() noexcept {
+            return task<R>(std::coroutine_handle<task_promise<R>>::from_promise(*this));
+        }
+
+        inline task<void> task_promise<void>::get_return_object() noexcept {
+            return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+        }
+
+        // frame of sync_wait(), counts itself done once fully suspended so
+        // the blocked caller may destroy it right away
+        class sync_wait_task {
+            public:
+                class promise_type {
+                    public:
+                        sync_wait_task get_return_object() noexcept {
+                            return sync_wait_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+                        }
+
+                        std::suspend_always initial_suspend() noexcept {
+                            return {};
+                        }
+
+                        auto final_suspend() noexcept {
+                            class notify {
+                                public:
+                                    bool await_ready() const noexcept {
+                                        return false;
+                                    }
+
+                                    void await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                                        handle.promise().counter->done();
+                                    }
+
+                                    void await_resume() const noexcept {}
+                            };
+                            return notify{};
+                        }
+
+                        void return_void() noexcept {}
+
+                        void unhandled_exception() noexcept {
+                            std::terminate();
+                        }
+
+                        inflight_counter *counter = nullptr;
+                };
+
+                std::coroutine_handle<promise_type> handle;
+        };
+
+        template <typename R>
+        sync_wait_task run_and_store(task<R> &work, std::optional<R> &value, std::exception_ptr &error) {
+            try {
+                value.emplace(co_await work);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+
+        inline sync_wait_task run_and_store(task<void> &work, std::exception_ptr &error) {
+            try {
+                co_await work;
+            } catch (...) {
+                error = std::current_exception();
+            }
+        }
+
+        // detached frame of spawn(), destroys itself when the body returns
+        class spawned_task {
+            public:
+                class promise_type {
+                    public:
+                        spawned_task get_return_object() noexcept {
+                            return {};
+                        }
+
+                        std::suspend_never initial_suspend() noexcept {
+                            return {};
+                        }
+
+                        std::suspend_never final_suspend() noexcept {
+                            return {};
+                        }
+
+                        void return_void() noexcept {}
+
+                        // a pool that was cleaned up before the work could
+                        // resume ends it quietly, anything else terminates
+                        void unhandled_exception() noexcept {
+                            try {
+                                throw;
+                            } catch (const task_dropped &) {
+                            } catch (...) {
+                                std::terminate();
+                            }
+                        }
+                };
+        };
+
+        template <typename T>
+        spawned_task run_detached(schedule_awaiter<T> start, task<void> work) {
+            co_await start;
+            co_await work;
+        }
+
+        inline void sync_wait_frame(sync_wait_task frame) {
+            inflight_counter counter;
+            counter.add();
+            frame.handle.promise().counter = &counter;
+            frame.handle.resume();
+            counter.wait();
+            frame.handle.destroy();
+        }
+
+    }
+
+    // blocks the calling thread until work has finished and returns its
+    // result; the boundary between plain threads and coroutines, a worker
+    // of the pool the task awaits must not call it
+    template <typename R>
+    R sync_wait(task<R> work) {
+        std::optional<R> value;
+        std::exception_ptr error;
+        detail::sync_wait_frame(detail::run_and_store(work, value, error));
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+
+    inline void sync_wait(task<void> work) {
+        std::exception_ptr error;
+        detail::sync_wait_frame(detail::run_and_store(work, error));
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // starts work on a worker without waiting for it; nobody is left to
+    // rethrow an escaping exception to, so it terminates unless it is the
+    // task_dropped of a pool cleaned up under it
+    template <typename T>
+    void spawn(thread_pool<T> &pool, task<void> work) {
+        detail::run_detached(pool.schedule(), std::move(work));
+    }
+
+    template <typename T>
+    void spawn(thread_pool<T> &pool, task<void> work, int stream_id) {
+        detail::run_detached(pool.schedule(stream_id), std::move(work));
+    }
+
+    // co_await completion(pool, task) suspends until a task queued with
+    // async() has run (or was dropped) and resumes on a worker of pool,
+    // instead of holding a thread in pool.sync(task, false)
+    template <typename T>
+    class completion_awaiter {
+        public:
+            bool await_ready() const noexcept {
+                return this->target->status;
+            }
+
+            void await_suspend(std::coroutine_handle<> handle) {
+                auto pool = this->pool;
+                auto stream_id = this->stream_id;
+                auto lost = &this->lost;
+                this->target->on_complete([pool, stream_id, handle, lost] {
+                    using resume = resume_task<std::coroutine_handle<>>;
+                    // runs outside the try of task_base::run(), and from
+                    // drop() in clean_all(); a refused resume has resumed
+                    // the coroutine inline with lost set before post() throws
+                    try {
+                        if (stream_id < 0) {
+                            pool->post(resume(handle, lost));
+                        } else {
+                            pool->post(resume(handle, lost), stream_id);
+                        }
+                    } catch (...) {}
+                });
+            }
+
+            // false when the task was dropped instead of run, rethrows what
+            // its process() threw; task_dropped when the resume itself was
+            // dropped by the pool
+            bool await_resume() const {
+                if (this->lost) {
+                    throw task_dropped();
+                }
+                this->target->rethrow();
+                return !this->target->dropped;
+            }
+
+            thread_pool<T> *pool;
+            std::shared_ptr<task_base> target;
+            int stream_id;
+            bool lost = false;
+    };
+
+    template <typename T>
+    completion_awaiter<T> completion(thread_pool<T> &pool, std::shared_ptr<task_base> target) {
+        return completion_awaiter<T>{&pool, std::move(target), pool.current_stream()};
+    }
+
+}
+
+#endif // __HPC_COROUTINE_HPP__
@@ -8,6 +8,7 @@
 #include <vector>
 #include <string>
 #include <bitset>
+#include <exception>
 #include <sstream>
 #include <iostream>
 #include <thread>
@@ -16,9 +17,22 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 
+#include "topology.hpp"
+
 namespace hpc {
 
     const int MAX_THREADS = 1000;
+    // data written by different threads is kept at least this far apart
+    const std::size_t CACHE_LINE_SIZE = 64;
+
+    // N bytes of padding, line_pad<0> leaves a member unpadded
+    template <std::size_t N>
+    class line_pad {
+        char pad[N];
+    };
+
+    template <>
+    class line_pad<0> {};
 
     #ifdef SYS_gettid
         #define gettid() ((pid_t)syscall(SYS_gettid))
@@ -29,14 +43,23 @@ namespace hpc {
         #error "SYS_gettid unavailable on this system"
     #endif
 
-    // http://www.cplusplus.com/forum/unices/6544/
     int get_hardware_sockets() {
-        std::string cmd = "lscpu | grep -e 'Socket(s)' | awk  -F ':' '{print $2}' | awk '$1=$1'";
-        FILE * fp = popen(cmd.c_str(),"r");
-        char sockets[8];
-        while (fgets(sockets, sizeof(sockets), fp) != NULL) {};
-        fclose(fp);
-        return std::stoi(sockets);
+        return cpu_topology::local().socket_num;
+    }
+
+    int get_hardware_nodes() {
+        return cpu_topology::local().node_num;
+    }
+
+    // spin-wait hint, lets the sibling hyperthread run while we poll
+    void cpu_relax() {
+    #if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+    #elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+    #else
+        std::this_thread::yield();
+    #endif
     }
 
     std::size_t get_hardware_concurrency() {
@@ -51,11 +74,11 @@ namespace hpc {
         CPU_ZERO(&cpuset);
         std::vector<int> cores;
         if (0 == sched_getaffinity(getpid(), sizeof(cpu_set_t), &cpuset)) {
-            const int nCores = sysconf( _SC_NPROCESSORS_ONLN );
+            // cpu ids can be sparse, scan the whole set rather than the online count
             if (verboe) {
                 std::cout << "affinity cores: ";
             }
-            for (int i = 0; i < nCores; i++) {
+            for (int i = 0; i < CPU_SETSIZE; i++) {
                 if (CPU_ISSET(i, &cpuset)) {
                     cores.emplace_back(i);
                     if (verboe) {
@@ -81,6 +104,27 @@ namespace hpc {
         return sched_setaffinity(0, sizeof(mask), &mask);
     }
 
+    // Runs fn on a short-lived thread pinned to cores. Linux places a page on
+    // the node of the cpu that first writes it, so whatever fn allocates and
+    // initializes ends up local to those cores. An exception of fn is
+    // rethrown on the caller.
+    template <typename F>
+    void run_on_cores(std::vector<int> cores, F &&fn) {
+        std::exception_ptr error;
+        std::thread placer([&cores, &fn, &error] {
+            set_thread_affinity(cores);
+            try {
+                fn();
+            } catch (...) {
+                error = std::current_exception();
+            }
+        });
+        placer.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
 }
 
 #endif // __HPC_CPU_HPP__
@@ -0,0 +1,165 @@
+#pragma once
+
+#ifndef __HPC_DEQUE_HPP__
+#define __HPC_DEQUE_HPP__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include "cpu.hpp"
+
+namespace hpc {
+
+    // Chase-Lev work-stealing deque, memory orders follow
+    // "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP'13).
+    // The owner thread calls push()/pop() on the bottom end, any other thread
+    // may steal() from the top end. E must be trivially copyable (a pointer).
+    // Pad separates top from bottom and from neighbouring allocations, 0
+    // gives the unpadded layout that main.cpp --false-sharing compares with.
+    template <typename E, std::size_t Pad = CACHE_LINE_SIZE>
+    class work_stealing_deque {
+        public:
+            explicit work_stealing_deque(std::size_t capacity=256);
+
+            void push(E item);
+            bool pop(E &item);
+            bool steal(E &item);
+            std::size_t size() const;
+            bool empty() const;
+
+        private:
+            class ring {
+                public:
+                    // value-initialized so the pages are touched by the allocating thread
+                    explicit ring(std::size_t capacity)
+                        : mask(capacity - 1), items(new std::atomic<E>[capacity]()) {}
+
+                    std::size_t capacity() const {
+                        return this->mask + 1;
+                    }
+
+                    E get(std::int64_t i) const {
+                        return this->items[i & this->mask].load(std::memory_order_relaxed);
+                    }
+
+                    void put(std::int64_t i, E item) {
+                        this->items[i & this->mask].store(item, std::memory_order_relaxed);
+                    }
+
+                private:
+                    std::size_t mask;
+                    std::unique_ptr<std::atomic<E>[]> items;
+            };
+
+            ring *grow(ring *old, std::int64_t bottom, std::int64_t top);
+
+            // thieves CAS top while the owner keeps writing bottom, so they
+            // sit on separate lines, and away from whatever is allocated next
+            line_pad<Pad> pad0;
+            std::atomic<std::int64_t> top;
+            line_pad<(Pad > sizeof(std::atomic<std::int64_t>) ? Pad - sizeof(std::atomic<std::int64_t>) : 0)> pad1;
+            std::atomic<std::int64_t> bottom;
+            std::atomic<ring *> buffer;
+            // retired rings stay alive until the deque dies, a thief may still read them
+            std::vector<std::unique_ptr<ring>> rings;
+            line_pad<Pad> pad2;
+    };
+
+    template <typename E, std::size_t Pad>
+    work_stealing_deque<E, Pad>::work_stealing_deque(std::size_t capacity)
+        : top(0), bottom(0) {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        this->rings.emplace_back(new ring(size));
+        this->buffer.store(this->rings.back().get(), std::memory_order_relaxed);
+    }
+
+    template <typename E, std::size_t Pad>
+    typename work_stealing_deque<E, Pad>::ring *work_stealing_deque<E, Pad>::grow(
+        ring *old, std::int64_t bottom, std::int64_t top) {
+        this->rings.emplace_back(new ring(old->capacity() * 2));
+        auto next = this->rings.back().get();
+        for (auto i = top; i < bottom; i++) {
+            next->put(i, old->get(i));
+        }
+        this->buffer.store(next, std::memory_order_release);
+        return next;
+    }
+
+    template <typename E, std::size_t Pad>
+    void work_stealing_deque<E, Pad>::push(E item) {
+        auto b = this->bottom.load(std::memory_order_relaxed);
+        auto t = this->top.load(std::memory_order_acquire);
+        auto a = this->buffer.load(std::memory_order_relaxed);
+        if (b - t > static_cast<std::int64_t>(a->capacity()) - 1) {
+            a = this->grow(a, b, t);
+        }
+        a->put(b, item);
+        // release store rather than fence + relaxed store, free on x86 and
+        // visible to ThreadSanitizer which does not model standalone fences
+        this->bottom.store(b + 1, std::memory_order_release);
+    }
+
+    template <typename E, std::size_t Pad>
+    bool work_stealing_deque<E, Pad>::pop(E &item) {
+        auto b = this->bottom.load(std::memory_order_relaxed) - 1;
+        auto a = this->buffer.load(std::memory_order_relaxed);
+        this->bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto t = this->top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            this->bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = a->get(b);
+        if (t == b) {
+            // last element, race against thieves for it
+            bool won = this->top.compare_exchange_strong(
+                t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            this->bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    template <typename E, std::size_t Pad>
+    bool work_stealing_deque<E, Pad>::steal(E &item) {
+        auto t = this->top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto b = this->bottom.load(std::memory_order_acquire);
+
+        if (t >= b) {
+            return false;
+        }
+
+        auto a = this->buffer.load(std::memory_order_acquire);
+        auto candidate = a->get(t);
+        if (!this->top.compare_exchange_strong(
+                t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            return false;
+        }
+        item = candidate;
+        return true;
+    }
+
+    template <typename E, std::size_t Pad>
+    std::size_t work_stealing_deque<E, Pad>::size() const {
+        auto b = this->bottom.load(std::memory_order_relaxed);
+        auto t = this->top.load(std::memory_order_relaxed);
+        return b > t ? static_cast<std::size_t>(b - t) : 0;
+    }
+
+    template <typename E, std::size_t Pad>
+    bool work_stealing_deque<E, Pad>::empty() const {
+        return this->size() == 0;
+    }
+
+}
+
+#endif // __HPC_DEQUE_HPP__
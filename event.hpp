@@ -0,0 +1,235 @@
+#pragma once
+
+#ifndef __HPC_EVENT_HPP__
+#define __HPC_EVENT_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "cpu.hpp"
+
+namespace hpc {
+
+    // wait_ns < 0 blocks without timeout
+    long futex_wait(std::atomic<int> *addr, int expected, long long wait_ns=-1) {
+        struct timespec ts;
+        struct timespec *timeout = nullptr;
+        if (wait_ns >= 0) {
+            ts.tv_sec = wait_ns / 1000000000;
+            ts.tv_nsec = wait_ns % 1000000000;
+            timeout = &ts;
+        }
+        return syscall(SYS_futex, reinterpret_cast<int *>(addr),
+                       FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+    }
+
+    long futex_wake(std::atomic<int> *addr, int count=INT_MAX) {
+        return syscall(SYS_futex, reinterpret_cast<int *>(addr),
+                       FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+    // one-shot flag: waiters spin for a while, then park on a futex.
+    // The spin budget adapts per thread, it grows when spinning was enough
+    // and halves each time the thread had to park anyway.
+    class completion_event {
+        public:
+            bool is_set() const {
+                return this->state.load(std::memory_order_acquire) == SET;
+            }
+
+            void set() {
+                if (this->state.exchange(SET, std::memory_order_acq_rel) == WAITING) {
+                    futex_wake(&this->state);
+                }
+            }
+
+            void reset() {
+                this->state.store(UNSET, std::memory_order_relaxed);
+            }
+
+            void wait() {
+                this->wait_until(std::chrono::steady_clock::time_point::max());
+            }
+
+            bool wait_for(double wait_ms) {
+                auto deadline = std::chrono::steady_clock::now()
+                              + std::chrono::microseconds(static_cast<long long>(wait_ms * 1000));
+                return this->wait_until(deadline);
+            }
+
+            bool wait_until(std::chrono::steady_clock::time_point deadline) {
+                if (this->spin()) {
+                    return true;
+                }
+
+                auto forever = deadline == std::chrono::steady_clock::time_point::max();
+                while (true) {
+                    auto current = this->state.load(std::memory_order_acquire);
+                    if (current == SET) {
+                        return true;
+                    }
+                    if (current == UNSET && !this->state.compare_exchange_weak(
+                            current, WAITING, std::memory_order_acq_rel)) {
+                        continue;
+                    }
+
+                    long long wait_ns = -1;
+                    if (!forever) {
+                        auto left = deadline - std::chrono::steady_clock::now();
+                        wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+                        if (wait_ns <= 0) {
+                            return this->is_set();
+                        }
+                    }
+                    futex_wait(&this->state, WAITING, wait_ns);
+                }
+            }
+
+        private:
+            static const int UNSET = 0;
+            static const int SET = 1;
+            static const int WAITING = 2;
+
+            static int &spin_budget() {
+                static thread_local int budget = 256;
+                return budget;
+            }
+
+            bool spin() {
+                auto &budget = spin_budget();
+                for (int i = 0; i < budget; i++) {
+                    if (this->is_set()) {
+                        budget = std::min(budget + budget / 8 + 1, 1 << 14);
+                        return true;
+                    }
+                    cpu_relax();
+                }
+                budget = std::max(budget / 2, 16);
+                return false;
+            }
+
+            std::atomic<int> state{UNSET};
+    };
+
+    // futex eventcount for idle workers: a waiter announces itself with
+    // prepare_wait(), rechecks its condition and only then sleeps on the key.
+    // notify() costs a fence and a load while nobody is parked.
+    class eventcount {
+        public:
+            int prepare_wait() {
+                this->waiters.fetch_add(1);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                return this->epoch.load();
+            }
+
+            void cancel_wait() {
+                this->waiters.fetch_sub(1);
+            }
+
+            // true when a notify ended the wait rather than a spurious wakeup
+            bool wait(int key) {
+                futex_wait(&this->epoch, key);
+                this->waiters.fetch_sub(1);
+                return this->epoch.load(std::memory_order_acquire) != key;
+            }
+
+            // called after publishing work, wakes at most count parked waiters
+            void notify(int count=1) {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                auto waiters = this->waiters.load();
+                if (waiters > 0) {
+                    this->epoch.fetch_add(1);
+                    futex_wake(&this->epoch, std::min(count, waiters));
+                }
+            }
+
+            void notify_all() {
+                this->epoch.fetch_add(1);
+                futex_wake(&this->epoch);
+            }
+
+            // waiters parked or about to park
+            int waiting() const {
+                return this->waiters.load(std::memory_order_relaxed);
+            }
+
+        private:
+            std::atomic<int> epoch{0};
+            std::atomic<int> waiters{0};
+    };
+
+    // count of outstanding work, wait() sleeps until it drops to zero.
+    // The count lives in the upper bits and bit 0 flags parked waiters, so
+    // done() needs no memory access after its decrement and the counter may
+    // be destroyed as soon as a waiter has observed zero.
+    class inflight_counter {
+        public:
+            void add(int n=1) {
+                this->state.fetch_add(n * 2, std::memory_order_relaxed);
+            }
+
+            void done(int n=1) {
+                auto previous = this->state.fetch_sub(n * 2, std::memory_order_acq_rel);
+                if ((previous >> 1) == n && (previous & 1)) {
+                    futex_wake(&this->state);
+                }
+            }
+
+            int load() const {
+                return this->state.load(std::memory_order_acquire) >> 1;
+            }
+
+            void reset() {
+                this->state.store(0);
+                futex_wake(&this->state);
+            }
+
+            void wait() {
+                this->wait_until(std::chrono::steady_clock::time_point::max());
+            }
+
+            bool wait_for(double wait_ms) {
+                auto deadline = std::chrono::steady_clock::now()
+                              + std::chrono::microseconds(static_cast<long long>(wait_ms * 1000));
+                return this->wait_until(deadline);
+            }
+
+            bool wait_until(std::chrono::steady_clock::time_point deadline) {
+                auto forever = deadline == std::chrono::steady_clock::time_point::max();
+                while (true) {
+                    auto current = this->state.load(std::memory_order_acquire);
+                    if ((current >> 1) == 0) {
+                        // drop a stale waiter flag, everyone parked was woken at zero
+                        if (current == 1) {
+                            this->state.compare_exchange_strong(current, 0);
+                        }
+                        return true;
+                    }
+                    if (!(current & 1) && !this->state.compare_exchange_weak(current, current | 1)) {
+                        continue;
+                    }
+
+                    long long wait_ns = -1;
+                    if (!forever) {
+                        auto left = deadline - std::chrono::steady_clock::now();
+                        wait_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+                        if (wait_ns <= 0) {
+                            return false;
+                        }
+                    }
+                    futex_wait(&this->state, current | 1, wait_ns);
+                }
+            }
+
+        private:
+            std::atomic<int> state{0};
+    };
+
+}
+
+#endif // __HPC_EVENT_HPP__
@@ -0,0 +1,243 @@
+#pragma once
+
+#ifndef __HPC_FUTURE_HPP__
+#define __HPC_FUTURE_HPP__
+
+#include <memory>
+#include <utility>
+#include <exception>
+#include <type_traits>
+
+#include "task.hpp"
+
+namespace hpc {
+
+    // task_base that also carries the value produced by process()
+    template <typename R>
+    class result_task : public task_base {
+        public:
+            ~result_task() {
+                if (this->has_value) {
+                    this->value().~R();
+                }
+            }
+
+            R &get() {
+                this->wait();
+                if (this->dropped) {
+                    throw task_dropped();
+                }
+                this->rethrow();
+                return this->value();
+            }
+
+        protected:
+            template <typename... Args>
+            void set_value(Args&&... args) {
+                new (&this->storage) R(std::forward<Args>(args)...);
+                this->has_value = true;
+            }
+
+        private:
+            R &value() {
+                return *reinterpret_cast<R *>(&this->storage);
+            }
+
+            typename std::aligned_storage<sizeof(R), alignof(R)>::type storage;
+            bool has_value = false;
+    };
+
+    template <>
+    class result_task<void> : public task_base {
+        public:
+            void get() {
+                this->wait();
+                if (this->dropped) {
+                    throw task_dropped();
+                }
+                this->rethrow();
+            }
+    };
+
+    // adapts any callable to the task_base interface
+    template <typename R, typename F>
+    class function_task : public result_task<R> {
+        public:
+            explicit function_task(F fn) : fn(std::move(fn)) {}
+
+            void process() {
+                this->set_value(this->fn());
+            }
+
+        private:
+            F fn;
+    };
+
+    template <typename F>
+    class function_task<void, F> : public result_task<void> {
+        public:
+            explicit function_task(F fn) : fn(std::move(fn)) {}
+
+            void process() {
+                this->fn();
+            }
+
+        private:
+            F fn;
+    };
+
+    template <typename F, typename... Args>
+    using invoke_result_t = decltype(std::declval<F>()(std::declval<Args>()...));
+
+    template <typename R>
+    class future;
+
+    template <typename R, typename F>
+    future<R> make_function_future(F &&fn);
+
+    // handle on a task submitted to a pool, copies share the same task
+    template <typename R>
+    class future {
+        public:
+            future() = default;
+            explicit future(std::shared_ptr<result_task<R>> state) : state(std::move(state)) {}
+
+            bool valid() const {
+                return this->state != nullptr;
+            }
+
+            bool ready() const {
+                return this->state->status;
+            }
+
+            void wait() const {
+                this->state->wait();
+            }
+
+            bool wait_for(double wait_ms) const {
+                return this->state->wait(wait_ms);
+            }
+
+            R &get() const {
+                return this->state->get();
+            }
+
+            // skipped if still queued, see task_base::cancel()
+            void cancel() const {
+                this->state->cancel();
+            }
+
+            // fn(R&) runs inline on the thread completing this future,
+            // a dropped future drops its continuations as well and a failed one
+            // fails them with the same exception
+            template <typename F>
+            future<invoke_result_t<F, R &>> then(F &&fn) const {
+                auto state = this->state;
+                auto callback = std::forward<F>(fn);
+                auto next = make_function_future<invoke_result_t<F, R &>>(
+                    [state, callback]() mutable { return callback(state->get()); });
+                auto task = next.task();
+                this->state->on_complete([task, state]() {
+                    try {
+                        if (state->dropped) {
+                            task->drop();
+                        } else if (state->error) {
+                            task->fail(state->error);
+                        } else {
+                            task->run();
+                        }
+                    } catch (...) {
+                        if (!task->status) {
+                            task->fail(std::current_exception());
+                        }
+                    }
+                });
+                return next;
+            }
+
+            std::shared_ptr<result_task<R>> task() const {
+                return this->state;
+            }
+
+        private:
+            std::shared_ptr<result_task<R>> state;
+    };
+
+    // future<void> can wrap any task_base, including user subclasses
+    template <>
+    class future<void> {
+        public:
+            future() = default;
+            future(std::shared_ptr<task_base> state) : state(std::move(state)) {}
+
+            bool valid() const {
+                return this->state != nullptr;
+            }
+
+            bool ready() const {
+                return this->state->status;
+            }
+
+            void wait() const {
+                this->state->wait();
+            }
+
+            bool wait_for(double wait_ms) const {
+                return this->state->wait(wait_ms);
+            }
+
+            void get() const {
+                this->state->wait();
+                if (this->state->dropped) {
+                    throw task_dropped();
+                }
+                this->state->rethrow();
+            }
+
+            void cancel() const {
+                this->state->cancel();
+            }
+
+            // fn() runs inline on the thread completing this future,
+            // a dropped future drops its continuations as well and a failed one
+            // fails them with the same exception
+            template <typename F>
+            future<invoke_result_t<F>> then(F &&fn) const {
+                auto state = this->state;
+                auto next = make_function_future<invoke_result_t<F>>(std::forward<F>(fn));
+                auto task = next.task();
+                this->state->on_complete([task, state]() {
+                    try {
+                        if (state->dropped) {
+                            task->drop();
+                        } else if (state->error) {
+                            task->fail(state->error);
+                        } else {
+                            task->run();
+                        }
+                    } catch (...) {
+                        if (!task->status) {
+                            task->fail(std::current_exception());
+                        }
+                    }
+                });
+                return next;
+            }
+
+            std::shared_ptr<task_base> task() const {
+                return this->state;
+            }
+
+        private:
+            std::shared_ptr<task_base> state;
+    };
+
+    template <typename R, typename F>
+    future<R> make_function_future(F &&fn) {
+        using task_type = function_task<R, typename std::decay<F>::type>;
+        return future<R>(std::make_shared<task_type>(std::forward<F>(fn)));
+    }
+
+}
+
+#endif // __HPC_FUTURE_HPP__
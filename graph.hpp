@@ -0,0 +1,409 @@
+#pragma once
+
+#ifndef __HPC_GRAPH_HPP__
+#define __HPC_GRAPH_HPP__
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <functional>
+
+#include "event.hpp"
+#include "task.hpp"
+#include "threadpool.hpp"
+
+namespace hpc {
+
+    // Static dependency graph executed on a thread_pool. Nodes are callables
+    // or task_base objects (only their process() is called, so they can be
+    // run again), edges are declared with precede(). A node becomes ready
+    // once all its predecessors finished; the worker that finished the last
+    // predecessor runs one ready successor inline and queues the others on
+    // its own stream, so data flows along a chain without leaving the core.
+    // The graph is kept between runs, run() may be called again as soon as
+    // the previous run is finished. cancel() skips the nodes of the current
+    // run that have not started, each run gets a fresh token linked to the
+    // group or graph node that started it. A node that throws cancels its
+    // run, the first exception is rethrown by wait() or by the next run().
+    // A node the pool refuses while it is being queued runs inline on the
+    // queuing thread instead; one the pool drops later fails the run with
+    // task_dropped, and it and whatever it would have released are
+    // counted down.
+    template <typename T>
+    class task_graph {
+        public:
+            explicit task_graph(thread_pool<T> &pool);
+            ~task_graph();
+
+            task_graph(const task_graph &) = delete;
+            task_graph &operator=(const task_graph &) = delete;
+
+            template <typename F, typename = invoke_result_t<F>>
+            std::size_t add(F &&fn);
+            std::size_t add(std::shared_ptr<task_base> task);
+            void precede(std::size_t from, std::size_t to);
+            void set_weight(std::size_t node, double weight);
+            double critical_path();
+            std::size_t size();
+            void run();
+            void wait();
+            bool wait_for(double wait_ms);
+            int pending();
+            void cancel();
+            bool cancelled();
+
+        private:
+            static const std::size_t NONE = static_cast<std::size_t>(-1);
+
+            class node {
+                public:
+                    std::function<void()> fn;
+                    // sorted by rank, longest remaining path first
+                    std::vector<std::size_t> successors;
+                    std::size_t predecessors = 0;
+                    // predecessors still running in the current run
+                    std::atomic<std::size_t> pending{0};
+                    // relative cost, 1 unless set_weight() was called
+                    double weight = 1;
+                    // weight of the heaviest path from this node to a sink
+                    double rank = 0;
+            };
+
+            // settles its node exactly once: when called, or when it is
+            // destroyed without having been called
+            class launch {
+                public:
+                    launch(task_graph *graph, std::size_t id) : graph(graph), id(id) {}
+
+                    launch(launch &&other) noexcept : graph(other.graph), id(other.id) {
+                        other.graph = nullptr;
+                    }
+
+                    launch(const launch &) = delete;
+                    launch &operator=(const launch &) = delete;
+
+                    ~launch() {
+                        if (this->graph != nullptr) {
+                            auto collector = collecting();
+                            if (collector != nullptr && collector->graph == this->graph) {
+                                // refused while launch_all() queues it
+                                collector->ids.push_back(this->id);
+                                return;
+                            }
+                            this->graph->error.set(std::make_exception_ptr(task_dropped()));
+                            this->graph->token.cancel();
+                            this->graph->execute(this->id, true);
+                        }
+                    }
+
+                    void operator()() {
+                        auto graph = this->graph;
+                        this->graph = nullptr;
+                        graph->execute(this->id, false);
+                    }
+
+                private:
+                    task_graph *graph;
+                    std::size_t id;
+            };
+
+            // launches of graph destroyed unrun on this thread during launch_all()
+            class refusal {
+                public:
+                    task_graph *graph;
+                    std::vector<std::size_t> ids;
+            };
+
+            static refusal *&collecting() {
+                static thread_local refusal *collector = nullptr;
+                return collector;
+            }
+
+            std::size_t add_node(std::function<void()> fn);
+            void check_node(std::size_t id);
+            void prepare();
+            void execute(std::size_t id, bool dropped);
+            void launch_all(const std::vector<std::size_t> &ids);
+            void join();
+
+            thread_pool<T> &pool;
+            std::vector<std::unique_ptr<node>> nodes;
+            // nodes without predecessors, sorted by rank
+            std::vector<std::size_t> sources;
+            // edges or weights changed since ranks were computed
+            bool dirty = true;
+            // of the current run
+            cancellation_token token;
+            inflight_counter counter;
+            first_error error;
+    };
+
+    template <typename T>
+    task_graph<T>::task_graph(thread_pool<T> &pool) : pool(pool) {}
+
+    template <typename T>
+    task_graph<T>::~task_graph() {
+        this->join();
+    }
+
+    template <typename T>
+    template <typename F, typename>
+    std::size_t task_graph<T>::add(F &&fn) {
+        return this->add_node(std::function<void()>(std::forward<F>(fn)));
+    }
+
+    template <typename T>
+    std::size_t task_graph<T>::add(std::shared_ptr<task_base> task) {
+        return this->add_node([task] { task->process(); });
+    }
+
+    template <typename T>
+    std::size_t task_graph<T>::add_node(std::function<void()> fn) {
+        this->join();
+        this->nodes.emplace_back(new node());
+        this->nodes.back()->fn = std::move(fn);
+        this->dirty = true;
+        return this->nodes.size() - 1;
+    }
+
+    template <typename T>
+    void task_graph<T>::check_node(std::size_t id) {
+        if (id >= this->nodes.size()) {
+            throw std::out_of_range("graph node out of range");
+        }
+    }
+
+    // to runs only after from has finished
+    template <typename T>
+    void task_graph<T>::precede(std::size_t from, std::size_t to) {
+        this->check_node(from);
+        this->check_node(to);
+        this->join();
+        this->nodes[from]->successors.push_back(to);
+        this->nodes[to]->predecessors++;
+        this->dirty = true;
+    }
+
+    // relative cost of a node, only used to order ready nodes along the
+    // critical path
+    template <typename T>
+    void task_graph<T>::set_weight(std::size_t id, double weight) {
+        this->check_node(id);
+        this->join();
+        this->nodes[id]->weight = weight;
+        this->dirty = true;
+    }
+
+    // total weight of the heaviest path through the graph
+    template <typename T>
+    double task_graph<T>::critical_path() {
+        this->join();
+        this->prepare();
+        double length = 0;
+        for (auto id : this->sources) {
+            length = std::max(length, this->nodes[id]->rank);
+        }
+        return length;
+    }
+
+    template <typename T>
+    std::size_t task_graph<T>::size() {
+        return this->nodes.size();
+    }
+
+    // topological order by Kahn's algorithm, then ranks from the sinks back
+    template <typename T>
+    void task_graph<T>::prepare() {
+        if (!this->dirty) {
+            return;
+        }
+        auto count = this->nodes.size();
+        std::vector<std::size_t> order;
+        std::vector<std::size_t> remaining(count);
+        order.reserve(count);
+        for (std::size_t i = 0; i < count; i++) {
+            remaining[i] = this->nodes[i]->predecessors;
+            if (remaining[i] == 0) {
+                order.push_back(i);
+            }
+        }
+        for (std::size_t i = 0; i < order.size(); i++) {
+            for (auto s : this->nodes[order[i]]->successors) {
+                if (--remaining[s] == 0) {
+                    order.push_back(s);
+                }
+            }
+        }
+        if (order.size() != count) {
+            throw std::logic_error("task graph has a cycle");
+        }
+
+        for (auto i = count; i > 0; i--) {
+            auto &current = *this->nodes[order[i - 1]];
+            double longest = 0;
+            for (auto s : current.successors) {
+                longest = std::max(longest, this->nodes[s]->rank);
+            }
+            current.rank = current.weight + longest;
+        }
+        auto by_rank = [this](std::size_t a, std::size_t b) {
+            return this->nodes[a]->rank > this->nodes[b]->rank;
+        };
+        this->sources.clear();
+        for (std::size_t i = 0; i < count; i++) {
+            auto &successors = this->nodes[i]->successors;
+            std::stable_sort(successors.begin(), successors.end(), by_rank);
+            if (this->nodes[i]->predecessors == 0) {
+                this->sources.push_back(i);
+            }
+        }
+        std::stable_sort(this->sources.begin(), this->sources.end(), by_rank);
+        this->dirty = false;
+    }
+
+    // waits for the previous run, then queues the sources, heaviest path first
+    template <typename T>
+    void task_graph<T>::run() {
+        this->wait();
+        this->prepare();
+        if (this->nodes.empty()) {
+            return;
+        }
+        for (auto &current : this->nodes) {
+            current->pending.store(current->predecessors, std::memory_order_relaxed);
+        }
+        this->token = scoped_token();
+        this->counter.add(this->nodes.size());
+        this->launch_all(this->sources);
+    }
+
+    // ids come heaviest first. A worker queues them on its own deque, which
+    // pops the newest first, so there the heaviest is pushed last. Launches
+    // the pool refuses (reject) or evicts (drop_oldest) while this thread
+    // queues are collected and run inline afterwards, the way caller_runs
+    // would, so the run goes on and the caller always reaches counter.done().
+    template <typename T>
+    void task_graph<T>::launch_all(const std::vector<std::size_t> &ids) {
+        refusal refused{this, {}};
+        auto outer = collecting();
+        collecting() = &refused;
+        auto stream_id = this->pool.current_stream();
+        if (stream_id < 0) {
+            for (auto id : ids) {
+                try {
+                    this->pool.post(launch(this, id));
+                } catch (...) {}
+            }
+        } else {
+            for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+                try {
+                    this->pool.post(launch(this, *it), stream_id);
+                } catch (...) {}
+            }
+        }
+        collecting() = outer;
+
+        std::stable_sort(refused.ids.begin(), refused.ids.end(), [this](std::size_t a, std::size_t b) {
+            return this->nodes[a]->rank > this->nodes[b]->rank;
+        });
+        for (auto id : refused.ids) {
+            this->execute(id, false);
+        }
+    }
+
+    // runs id, then keeps going with the heaviest successor it released;
+    // once cancelled the remaining nodes are only counted down. A dropped
+    // launch counts down its node and the nodes it releases right here,
+    // nothing is queued on a pool that is dropping work.
+    template <typename T>
+    void task_graph<T>::execute(std::size_t id, bool dropped) {
+        std::vector<std::size_t> ready;
+        while (true) {
+            auto &current = *this->nodes[id];
+            if (!dropped && !this->token.cancelled()) {
+                token_scope scope(this->token);
+                try {
+                    current.fn();
+                } catch (...) {
+                    this->error.set(std::current_exception());
+                    this->token.cancel();
+                }
+            }
+
+            auto next = NONE;
+            for (auto s : current.successors) {
+                if (this->nodes[s]->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+                    continue;
+                }
+                if (next == NONE) {
+                    next = s;
+                } else {
+                    ready.push_back(s);
+                }
+            }
+            if (!dropped) {
+                this->launch_all(ready);
+                ready.clear();
+            }
+            // the waiter may destroy the graph once the last node is done,
+            // ready is empty by then
+            this->counter.done();
+            if (next == NONE) {
+                if (ready.empty()) {
+                    return;
+                }
+                next = ready.back();
+                ready.pop_back();
+            }
+            id = next;
+        }
+    }
+
+    template <typename T>
+    void task_graph<T>::wait() {
+        this->join();
+        this->error.rethrow();
+    }
+
+    template <typename T>
+    void task_graph<T>::join() {
+        while (this->counter.load() != 0) {
+            if (!this->pool.try_run_one()) {
+                // nothing left to help with, the rest is already running
+                this->counter.wait();
+            }
+        }
+    }
+
+    template <typename T>
+    bool task_graph<T>::wait_for(double wait_ms) {
+        if (!this->counter.wait_for(wait_ms)) {
+            return false;
+        }
+        this->error.rethrow();
+        return true;
+    }
+
+    // nodes of the current run that have not finished yet
+    template <typename T>
+    int task_graph<T>::pending() {
+        return this->counter.load();
+    }
+
+    template <typename T>
+    void task_graph<T>::cancel() {
+        this->token.cancel();
+    }
+
+    template <typename T>
+    bool task_graph<T>::cancelled() {
+        return this->token.cancelled();
+    }
+
+}
+
+#endif // __HPC_GRAPH_HPP__
@@ -0,0 +1,179 @@
+#pragma once
+
+#ifndef __HPC_GROUP_HPP__
+#define __HPC_GROUP_HPP__
+
+#include <utility>
+#include <exception>
+
+#include "event.hpp"
+#include "task.hpp"
+#include "threadpool.hpp"
+
+namespace hpc {
+
+    // fork-join scope over a thread_pool: run() spawns, wait() joins.
+    // The joining thread executes queued tasks while the group is unfinished.
+    // cancel() skips members that have not started yet; running ones can
+    // poll cancellation_requested(). A group created inside a member of
+    // another group or graph is cancelled along with it. The first exception
+    // a member throws cancels the group and is rethrown by wait(), the
+    // destructor only joins and drops it. A member the pool drops or refuses
+    // without running it fails the group the same way, with task_dropped.
+    template <typename T>
+    class task_group {
+        public:
+            explicit task_group(thread_pool<T> &pool);
+            task_group(thread_pool<T> &pool, const cancellation_token &parent);
+            ~task_group();
+
+            task_group(const task_group &) = delete;
+            task_group &operator=(const task_group &) = delete;
+
+            template <typename F>
+            void run(F &&fn);
+            template <typename F>
+            void run(F &&fn, int stream_id);
+            void wait();
+            bool wait_for(double wait_ms);
+            int pending();
+            void cancel();
+            bool cancelled();
+            const cancellation_token &token();
+
+        private:
+            // counts itself down exactly once: when called, or when it is
+            // destroyed without having been called
+            template <typename F>
+            class member {
+                public:
+                    template <typename G>
+                    member(task_group *group, G &&fn) : group(group), fn(std::forward<G>(fn)) {}
+
+                    member(member &&other) : group(other.group), fn(std::move(other.fn)) {
+                        other.group = nullptr;
+                    }
+
+                    member(const member &) = delete;
+                    member &operator=(const member &) = delete;
+
+                    ~member() {
+                        if (this->group != nullptr) {
+                            this->group->fail(std::make_exception_ptr(task_dropped()));
+                            this->group->counter.done();
+                        }
+                    }
+
+                    void operator()() {
+                        auto group = this->group;
+                        this->group = nullptr;
+                        if (!group->token_.cancelled()) {
+                            token_scope scope(group->token_);
+                            try {
+                                this->fn();
+                            } catch (...) {
+                                group->fail(std::current_exception());
+                            }
+                        }
+                        group->counter.done();
+                    }
+
+                private:
+                    task_group *group;
+                    F fn;
+            };
+
+            void fail(std::exception_ptr error);
+            void join();
+
+            thread_pool<T> &pool;
+            cancellation_token token_;
+            inflight_counter counter;
+            first_error error;
+    };
+
+    template <typename T>
+    task_group<T>::task_group(thread_pool<T> &pool) : pool(pool), token_(scoped_token()) {}
+
+    template <typename T>
+    task_group<T>::task_group(thread_pool<T> &pool, const cancellation_token &parent)
+        : pool(pool), token_(parent.child()) {}
+
+    template <typename T>
+    task_group<T>::~task_group() {
+        this->join();
+    }
+
+    // the member is built before it is counted, and from then on settles
+    // the count itself, also when post() throws queue_full
+    template <typename T>
+    template <typename F>
+    void task_group<T>::run(F &&fn) {
+        member<typename std::decay<F>::type> task(this, std::forward<F>(fn));
+        this->counter.add();
+        this->pool.post(std::move(task));
+    }
+
+    template <typename T>
+    template <typename F>
+    void task_group<T>::run(F &&fn, int stream_id) {
+        member<typename std::decay<F>::type> task(this, std::forward<F>(fn));
+        this->counter.add();
+        this->pool.post(std::move(task), stream_id);
+    }
+
+    template <typename T>
+    void task_group<T>::wait() {
+        this->join();
+        this->error.rethrow();
+    }
+
+    // the first failure is kept, and cancels the members not started yet
+    template <typename T>
+    void task_group<T>::fail(std::exception_ptr error) {
+        this->error.set(std::move(error));
+        this->token_.cancel();
+    }
+
+    template <typename T>
+    void task_group<T>::join() {
+        while (this->counter.load() != 0) {
+            if (!this->pool.try_run_one()) {
+                // nothing left to help with, the rest is already running
+                this->counter.wait();
+            }
+        }
+    }
+
+    template <typename T>
+    bool task_group<T>::wait_for(double wait_ms) {
+        if (!this->counter.wait_for(wait_ms)) {
+            return false;
+        }
+        this->error.rethrow();
+        return true;
+    }
+
+    template <typename T>
+    int task_group<T>::pending() {
+        return this->counter.load();
+    }
+
+    template <typename T>
+    void task_group<T>::cancel() {
+        this->token_.cancel();
+    }
+
+    template <typename T>
+    bool task_group<T>::cancelled() {
+        return this->token_.cancelled();
+    }
+
+    template <typename T>
+    const cancellation_token &task_group<T>::token() {
+        return this->token_;
+    }
+
+}
+
+#endif // __HPC_GROUP_HPP__
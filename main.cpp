@@ -1,125 +1,488 @@
+#include <algorithm>
+#include <future>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "deque.hpp"
 #include "threadpool.hpp"
 #include "task.hpp"
 
-class task : public hpc::task_base {
-    private:
-        int block_ms;
-        int task_id;
-        bool verbose;
+// Benchmark suite: sweeps task granularity, producer count, stream/thread
+// layout and affinity, and compares the pool with a thread per task and
+// std::async. Latency is submit-to-completion of every single task.
+// pool_may_throw posts tasks that could throw but never do, next to
+// the plain thread_pool rows for the same layout: exception capture must
+// cost nothing until something throws.
+// --false-sharing runs the cache line microbenchmark instead.
+//
+// usage: main.out [--format=text|csv|json] [--quick] [--repeat=N] [--false-sharing]
 
+// the suite only submits callables, the pool still needs a task type
+class bench_task : public hpc::task_base {
     public:
-        task(int block_ms, int task_id, bool verbose) {
-            this->block_ms = block_ms;
-            this->task_id = task_id;
-            this->verbose = verbose;
-        };
-
-        void process() {
-            auto start = std::chrono::system_clock::now();
-            while (true) {
-                auto end = std::chrono::system_clock::now();
-                auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                auto block_time = double(duration.count())
-                                * std::chrono::microseconds::period::num
-                                / std::chrono::microseconds::period::den
-                                * 1000;
-                if (block_time > block_ms) {
-                    if (this->verbose) {
-                        std::cout << "task_id:" << this->task_id
-                                  << ", pid:" << getpid()
-                                  << ", tid:" << gettid()
-                                  << ", tidx:" << gettid() - getpid()
-                                  << ", time:" << block_time << "ms"
-                                  << std::endl;
-                    }
-                    break;
-                }
-            };
+        void process() {}
+};
+
+// busy work of roughly ns nanoseconds, 0 is an empty task
+void spin_for(std::uint64_t ns) {
+    if (ns == 0) {
+        return;
+    }
+    auto end = hpc::trace_now() + ns;
+    while (hpc::trace_now() < end) {};
+}
+
+class bench_config {
+    public:
+        std::string impl;
+        std::uint64_t granularity_ns;
+        int producers;
+        int streams;
+        int threads;
+        bool affinity;
+        hpc::schedule_policy schedule;
+        std::size_t tasks;
+};
+
+class bench_result {
+    public:
+        bench_config config;
+        int run;
+        double seconds;
+        double throughput;
+        double p50_us;
+        double p99_us;
+        double p999_us;
+        double max_us;
+        // as resolved by the pool, the config may leave them at 0
+        std::size_t streams;
+        std::size_t threads;
+};
+
+// per-task latencies written by whichever thread completed the task
+class latency_log {
+    public:
+        explicit latency_log(std::size_t tasks) : submitted(tasks), latencies(tasks) {}
+
+        void submit(std::size_t i) {
+            this->submitted[i] = hpc::trace_now();
+        }
+
+        void complete(std::size_t i) {
+            this->latencies[i] = hpc::trace_now() - this->submitted[i];
         }
 
-        int get() {
-            this->wait();
-            return this->task_base::task_time;
+        double percentile_us(double q) {
+            auto rank = static_cast<std::size_t>(q * (this->latencies.size() - 1));
+            std::nth_element(this->latencies.begin(), this->latencies.begin() + rank,
+                             this->latencies.end());
+            return this->latencies[rank] / 1000.0;
         }
+
+        std::vector<std::uint64_t> submitted;
+        std::vector<std::uint64_t> latencies;
 };
 
-int main() {
-    int loop = 1000;
-    int streams = 0;
-    int threads = 0;
-    bool affinity = true;
-    bool verbose = false;
+const char *schedule_name(hpc::schedule_policy schedule) {
+    switch (schedule) {
+        case hpc::schedule_policy::fifo: return "fifo";
+        case hpc::schedule_policy::work_stealing: return "work_stealing";
+        case hpc::schedule_policy::priority: return "priority";
+    }
+    return "unknown";
+}
+
+// producers split the task range evenly and submit concurrently
+template <typename S>
+void produce(int producers, std::size_t tasks, S &&submit) {
+    std::vector<std::thread> threads;
+    for (auto p = 0; p < producers; p++) {
+        threads.emplace_back([p, producers, tasks, &submit] {
+            for (auto i = tasks * p / producers; i < tasks * (p + 1) / producers; i++) {
+                submit(p, i);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+bench_result finish(const bench_config &config, latency_log &log,
+                    std::uint64_t start, std::uint64_t end,
+                    std::size_t streams, std::size_t threads) {
+    bench_result result;
+    result.config = config;
+    result.seconds = (end - start) / 1e9;
+    result.throughput = config.tasks / result.seconds;
+    result.p50_us = log.percentile_us(0.5);
+    result.p99_us = log.percentile_us(0.99);
+    result.p999_us = log.percentile_us(0.999);
+    result.max_us = log.percentile_us(1.0);
+    result.streams = streams;
+    result.threads = threads;
+    return result;
+}
+
+bench_result run_pool(const bench_config &config) {
+    hpc::thread_config pool_config;
+    pool_config.stream_num = config.streams;
+    pool_config.thread_num = config.threads;
+    pool_config.affinity = config.affinity;
+    pool_config.schedule = config.schedule;
+    hpc::thread_pool<bench_task> pool(pool_config);
+
+    // warm the slot caches and wake every worker once before measuring
+    for (std::size_t i = 0; i < pool.get_thread_num() * 16; i++) {
+        pool.post([] {});
+    }
+    pool.wait_all();
+
+    latency_log log(config.tasks);
+    auto granularity = config.granularity_ns;
+    auto start = hpc::trace_now();
+    if (config.impl == "pool_may_throw") {
+        // i never reaches tasks, but the compiler cannot tell
+        auto tasks = config.tasks;
+        produce(config.producers, config.tasks, [&pool, &log, granularity, tasks](int, std::size_t i) {
+            log.submit(i);
+            pool.post([&log, granularity, i, tasks] {
+                spin_for(granularity);
+                if (i >= tasks) {
+                    throw std::out_of_range("task index");
+                }
+                log.complete(i);
+            });
+        });
+    } else {
+        produce(config.producers, config.tasks, [&pool, &log, granularity](int, std::size_t i) {
+            log.submit(i);
+            pool.post([&log, granularity, i] {
+                spin_for(granularity);
+                log.complete(i);
+            });
+        });
+    }
+    pool.wait_all();
+    auto end = hpc::trace_now();
+    return finish(config, log, start, end, pool.get_stream_num(), pool.get_thread_num());
+}
+
+bench_result run_thread_per_task(const bench_config &config) {
+    latency_log log(config.tasks);
+    std::vector<std::vector<std::thread>> spawned(config.producers);
+    auto granularity = config.granularity_ns;
+    auto start = hpc::trace_now();
+    produce(config.producers, config.tasks, [&](int p, std::size_t i) {
+        log.submit(i);
+        spawned[p].emplace_back([&log, granularity, i] {
+            spin_for(granularity);
+            log.complete(i);
+        });
+    });
+    for (auto &threads : spawned) {
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+    auto end = hpc::trace_now();
+    return finish(config, log, start, end, 0, config.tasks);
+}
 
-    class hpc::thread_pool<task> tp(streams, threads, affinity, verbose);
+bench_result run_std_async(const bench_config &config) {
+    latency_log log(config.tasks);
+    std::vector<std::vector<std::future<void>>> futures(config.producers);
+    auto granularity = config.granularity_ns;
+    auto start = hpc::trace_now();
+    produce(config.producers, config.tasks, [&](int p, std::size_t i) {
+        log.submit(i);
+        futures[p].emplace_back(std::async(std::launch::async, [&log, granularity, i] {
+            spin_for(granularity);
+            log.complete(i);
+        }));
+    });
+    for (auto &producer : futures) {
+        for (auto &future : producer) {
+            future.get();
+        }
+    }
+    auto end = hpc::trace_now();
+    return finish(config, log, start, end, 0, config.tasks);
+}
 
-    // sync api : direct
-    {
-        tp.reset_all();
+// enough tasks for a run of roughly budget_ms on the whole machine
+std::size_t cal_tasks(std::uint64_t granularity_ns, double budget_ms, std::size_t limit) {
+    auto cost_ns = std::max<std::uint64_t>(granularity_ns, 200);
+    auto tasks = static_cast<std::size_t>(budget_ms * 1e6 * hpc::get_hardware_concurrency() / cost_ns);
+    return std::max<std::size_t>(std::min(tasks, limit), 100);
+}
 
-        auto start = std::chrono::system_clock::now();
+std::vector<bench_config> cal_configs(bool quick) {
+    int hardware = hpc::get_hardware_concurrency();
+    std::vector<std::uint64_t> granularities = {0, 1000, 10000, 100000, 1000000};
+    std::vector<int> producer_counts = {1, std::max(2, hardware / 2)};
+    // {streams, threads, affinity}, 0 lets the pool decide
+    std::vector<std::tuple<int, int, bool>> layouts = {
+        std::make_tuple(0, 0, true),
+        std::make_tuple(0, 0, false),
+        std::make_tuple(1, 0, true),
+        std::make_tuple(std::max(1, hardware / 2), 0, true),
+    };
+    // thread count sweep on the default stream layout
+    std::vector<int> thread_counts = {1};
+    for (auto threads : {hardware / 2, hardware}) {
+        if (threads > thread_counts.back()) {
+            thread_counts.push_back(threads);
+        }
+    }
+    for (auto threads : thread_counts) {
+        layouts.push_back(std::make_tuple(0, threads, true));
+    }
+    std::vector<hpc::schedule_policy> schedules = {
+        hpc::schedule_policy::fifo,
+        hpc::schedule_policy::work_stealing,
+    };
+    double budget_ms = 200;
+    if (quick) {
+        granularities = {0, 10000, 1000000};
+        layouts.resize(2);
+        budget_ms = 20;
+    }
 
-        auto id = loop;
-        while (id--) {
-            tp.sync(std::make_shared<task>(10, id, verbose), true);
+    std::vector<bench_config> configs;
+    for (auto granularity : granularities) {
+        for (auto producers : producer_counts) {
+            for (auto &layout : layouts) {
+                for (auto schedule : schedules) {
+                    configs.push_back(bench_config{
+                        "thread_pool", granularity, producers,
+                        std::get<0>(layout), std::get<1>(layout), std::get<2>(layout),
+                        schedule, cal_tasks(granularity, budget_ms, 1000000)});
+                }
+            }
+            auto &layout = layouts.front();
+            configs.push_back(bench_config{
+                "pool_may_throw", granularity, producers,
+                std::get<0>(layout), std::get<1>(layout), std::get<2>(layout),
+                hpc::schedule_policy::fifo, cal_tasks(granularity, budget_ms, 1000000)});
+            // baselines spawn a thread per task, keep their task count small
+            auto tasks = cal_tasks(granularity, budget_ms, quick ? 200 : 2000);
+            configs.push_back(bench_config{"thread_per_task", granularity, producers,
+                                           0, 0, false, hpc::schedule_policy::fifo, tasks});
+            configs.push_back(bench_config{"std_async", granularity, producers,
+                                           0, 0, false, hpc::schedule_policy::fifo, tasks});
         }
+    }
+    return configs;
+}
+
+// one counter per thread, either next to each other or a cache line apart
+class packed_counter {
+    public:
+        std::atomic<std::uint64_t> value{0};
+};
 
-        auto end = std::chrono::system_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-        auto block_time = double(duration.count())
-                        * std::chrono::microseconds::period::num
-                        / std::chrono::microseconds::period::den;
-        std::cout << "Sync API(direct) Summary"
-                  << ", Whole Time: " << block_time << "s"
-                  << ", Avg Latency: " << block_time / loop * 1000 << "ms"
-                  << ", Avg QPS: " << loop / block_time
-                  << std::endl;
+class padded_counter {
+    public:
+        std::atomic<std::uint64_t> value{0};
+        char pad[hpc::CACHE_LINE_SIZE - sizeof(std::atomic<std::uint64_t>)];
+};
+
+// nanoseconds per operation when threads run op(thread) ops times each,
+// all released together once the clock has started
+template <typename O>
+double time_per_op(int threads, std::size_t ops, O &&op) {
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<std::thread> workers;
+    for (auto t = 0; t < threads; t++) {
+        workers.emplace_back([t, ops, &ready, &go, &op] {
+            ready.fetch_add(1);
+            while (!go.load()) {};
+            for (std::size_t i = 0; i < ops; i++) {
+                op(t);
+            }
+        });
     }
+    while (ready.load() < threads) {};
+    auto start = hpc::trace_now();
+    go.store(true);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    return double(hpc::trace_now() - start) / ops;
+}
 
-    // sync api : run by async api
-    {
-        tp.reset_all();
+// Every thread only touches its own data, so any slowdown with more
+// threads is the cache line bouncing between cores. packed and padded
+// are bare counters. deque is the pool's own per-worker deque allocated
+// back to back, which its padding keeps on separate lines, and
+// deque_unpadded the same deque built with its padding off, the layout
+// worker_context had before.
+void run_false_sharing(const std::string &format, bool quick, int repeat) {
+    int hardware = hpc::get_hardware_concurrency();
+    std::size_t ops = quick ? 1000000 : 10000000;
+    std::vector<int> thread_counts;
+    for (auto threads = 1; threads < hardware; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(hardware);
 
-        auto start = std::chrono::system_clock::now();
+    if (format == "csv") {
+        std::cout << "threads,run,packed_ns,padded_ns,deque_ns,deque_unpadded_ns" << std::endl;
+    } else if (format == "json") {
+        std::cout << "{\"hardware_concurrency\":" << hardware << ",\"false_sharing\":[" << std::endl;
+    } else {
+        std::cout << std::left << std::setw(9) << "threads" << std::setw(5) << "run"
+                  << std::setw(12) << "packed_ns" << std::setw(12) << "padded_ns"
+                  << std::setw(12) << "deque_ns" << std::setw(19) << "deque_unpadded_ns" << std::endl;
+    }
+    auto first = true;
+    for (auto threads : thread_counts) {
+        for (auto run = 0; run < repeat; run++) {
+            std::vector<packed_counter> packed(threads);
+            std::vector<padded_counter> padded(threads);
+            std::unique_ptr<hpc::work_stealing_deque<int *>[]> deques(
+                new hpc::work_stealing_deque<int *>[threads]);
+            std::unique_ptr<hpc::work_stealing_deque<int *, 0>[]> unpadded(
+                new hpc::work_stealing_deque<int *, 0>[threads]);
+            auto packed_ns = time_per_op(threads, ops, [&packed](int t) {
+                packed[t].value.fetch_add(1, std::memory_order_relaxed);
+            });
+            auto padded_ns = time_per_op(threads, ops, [&padded](int t) {
+                padded[t].value.fetch_add(1, std::memory_order_relaxed);
+            });
+            auto deque_ns = time_per_op(threads, ops, [&deques](int t) {
+                int *item = nullptr;
+                deques[t].push(item);
+                deques[t].pop(item);
+            });
+            auto unpadded_ns = time_per_op(threads, ops, [&unpadded](int t) {
+                int *item = nullptr;
+                unpadded[t].push(item);
+                unpadded[t].pop(item);
+            });
 
-        auto id = loop;
-        while (id--) {
-            tp.sync(std::make_shared<task>(10, id, verbose), false);
+            if (format == "csv") {
+                std::cout << threads << "," << run << "," << packed_ns << ","
+                          << padded_ns << "," << deque_ns << "," << unpadded_ns << std::endl;
+            } else if (format == "json") {
+                std::cout << (first ? "" : ",\n") << "{\"threads\":" << threads << ",\"run\":" << run
+                          << ",\"packed_ns\":" << packed_ns << ",\"padded_ns\":" << padded_ns
+                          << ",\"deque_ns\":" << deque_ns << ",\"deque_unpadded_ns\":" << unpadded_ns << "}";
+            } else {
+                std::cout << std::left << std::setw(9) << threads << std::setw(5) << run
+                          << std::setw(12) << std::setprecision(4) << packed_ns
+                          << std::setw(12) << padded_ns << std::setw(12) << deque_ns
+                          << std::setw(19) << unpadded_ns << std::endl;
+            }
+            first = false;
         }
+    }
+    if (format == "json") {
+        std::cout << "\n]}" << std::endl;
+    }
+}
 
-        auto end = std::chrono::system_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-        auto block_time = double(duration.count())
-                        * std::chrono::microseconds::period::num
-                        / std::chrono::microseconds::period::den;
-        std::cout << "Sync API(async) Summary"
-                  << ", Whole Time: " << block_time << "s"
-                  << ", Avg Latency: " << block_time / loop * 1000 << "ms"
-                  << ", Avg QPS: " << loop / block_time
-                  << std::endl;
+void print_header(const std::string &format) {
+    if (format == "csv") {
+        std::cout << "impl,granularity_ns,producers,streams,threads,affinity,schedule,tasks,run,"
+                  << "seconds,throughput,p50_us,p99_us,p999_us,max_us" << std::endl;
+    } else if (format == "json") {
+        std::cout << "{\"hardware_concurrency\":" << hpc::get_hardware_concurrency()
+                  << ",\"sockets\":" << hpc::get_hardware_sockets()
+                  << ",\"nodes\":" << hpc::get_hardware_nodes()
+                  << ",\"results\":[" << std::endl;
+    } else {
+        std::cout << "hardware concurrency: " << hpc::get_hardware_concurrency()
+                  << ", sockets: " << hpc::get_hardware_sockets()
+                  << ", nodes: " << hpc::get_hardware_nodes() << std::endl;
+        std::cout << std::left << std::setw(16) << "impl" << std::setw(10) << "grain_ns"
+                  << std::setw(6) << "prod" << std::setw(9) << "streams" << std::setw(9) << "threads"
+                  << std::setw(5) << "aff" << std::setw(15) << "schedule" << std::setw(9) << "tasks"
+                  << std::setw(14) << "tasks/s" << std::setw(11) << "p50_us"
+                  << std::setw(11) << "p99_us" << std::setw(11) << "p999_us" << std::endl;
     }
+}
 
-    // async api
-    {
-        tp.reset_all();
+void print_result(const std::string &format, const bench_result &result, bool first) {
+    auto &config = result.config;
+    if (format == "csv") {
+        std::cout << config.impl << "," << config.granularity_ns << "," << config.producers << ","
+                  << result.streams << "," << result.threads << "," << config.affinity << ","
+                  << schedule_name(config.schedule) << "," << config.tasks << "," << result.run << ","
+                  << result.seconds << "," << result.throughput << "," << result.p50_us << ","
+                  << result.p99_us << "," << result.p999_us << "," << result.max_us << std::endl;
+    } else if (format == "json") {
+        std::cout << (first ? "" : ",\n")
+                  << "{\"impl\":\"" << config.impl << "\",\"granularity_ns\":" << config.granularity_ns
+                  << ",\"producers\":" << config.producers << ",\"streams\":" << result.streams
+                  << ",\"threads\":" << result.threads
+                  << ",\"affinity\":" << (config.affinity ? "true" : "false")
+                  << ",\"schedule\":\"" << schedule_name(config.schedule) << "\""
+                  << ",\"tasks\":" << config.tasks << ",\"run\":" << result.run
+                  << ",\"seconds\":" << result.seconds << ",\"throughput\":" << result.throughput
+                  << ",\"p50_us\":" << result.p50_us << ",\"p99_us\":" << result.p99_us
+                  << ",\"p999_us\":" << result.p999_us << ",\"max_us\":" << result.max_us << "}";
+    } else {
+        std::cout << std::left << std::setw(16) << config.impl << std::setw(10) << config.granularity_ns
+                  << std::setw(6) << config.producers << std::setw(9) << result.streams
+                  << std::setw(9) << result.threads << std::setw(5) << config.affinity
+                  << std::setw(15) << schedule_name(config.schedule) << std::setw(9) << config.tasks
+                  << std::setw(14) << std::setprecision(6) << result.throughput
+                  << std::setw(11) << result.p50_us << std::setw(11) << result.p99_us
+                  << std::setw(11) << result.p999_us << std::endl;
+    }
+}
 
-        auto start = std::chrono::system_clock::now();
+int main(int argc, char **argv) {
+    std::string format = "text";
+    bool quick = false;
+    int repeat = 1;
+    bool false_sharing = false;
+    for (auto i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 9, "--format=") == 0) {
+            format = arg.substr(9);
+        } else if (arg == "--quick") {
+            quick = true;
+        } else if (arg.compare(0, 9, "--repeat=") == 0) {
+            repeat = std::max(1, std::stoi(arg.substr(9)));
+        } else if (arg == "--false-sharing") {
+            false_sharing = true;
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--format=text|csv|json] [--quick] [--repeat=N] [--false-sharing]" << std::endl;
+            return 1;
+        }
+    }
+    if (false_sharing) {
+        run_false_sharing(format, quick, repeat);
+        return 0;
+    }
 
-        auto id = loop * std::thread::hardware_concurrency();
-        while (id--) {
-            tp.async(std::make_shared<task>(10, id, verbose));
+    print_header(format);
+    auto first = true;
+    for (auto &config : cal_configs(quick)) {
+        for (auto run = 0; run < repeat; run++) {
+            bench_result result;
+            if (config.impl == "thread_per_task") {
+                result = run_thread_per_task(config);
+            } else if (config.impl == "std_async") {
+                result = run_std_async(config);
+            } else {
+                result = run_pool(config);
+            }
+            result.run = run;
+            print_result(format, result, first);
+            first = false;
         }
-        tp.wait_all();
-
-        auto end = std::chrono::system_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-        auto block_time = double(duration.count())
-                        * std::chrono::microseconds::period::num
-                        / std::chrono::microseconds::period::den;
-        std::cout << "Async API Summary"
-                  << ", Whole Time: " << block_time << "s"
-                  << ", Avg Latency: " << block_time / loop * 1000 << "ms"
-                  << ", Avg QPS: " << loop * std::thread::hardware_concurrency() / block_time
-                  << std::endl;
+    }
+    if (format == "json") {
+        std::cout << "\n]}" << std::endl;
     }
 
     return 0;
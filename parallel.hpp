@@ -0,0 +1,118 @@
+#pragma once
+
+#ifndef __HPC_PARALLEL_HPP__
+#define __HPC_PARALLEL_HPP__
+
+#include <vector>
+#include <algorithm>
+
+#include "group.hpp"
+#include "threadpool.hpp"
+
+namespace hpc {
+
+    // a few pieces per thread so stealing can even out uneven pieces
+    std::size_t cal_grain(std::size_t size, std::size_t thread_num) {
+        return std::max<std::size_t>(1, size / (std::max<std::size_t>(1, thread_num) * 4));
+    }
+
+    // keeps halving [begin, end) while it is longer than grain, spawning the
+    // right half on stream_id and carrying on with the left half inline
+    template <typename T, typename F>
+    void split_range(task_group<T> &group, std::size_t begin, std::size_t end,
+                     std::size_t grain, int stream_id, const F &fn) {
+        while (end - begin > grain) {
+            auto mid = begin + (end - begin) / 2;
+            group.run([&group, mid, end, grain, stream_id, &fn] {
+                split_range(group, mid, end, grain, stream_id, fn);
+            }, stream_id);
+            end = mid;
+        }
+        fn(begin, end);
+    }
+
+    // calls fn(first, last) on disjoint pieces covering [begin, end).
+    // The range is first shared out across streams in proportion to their
+    // thread count, then split recursively inside each stream. grain == 0
+    // picks a piece size from the pool size. The caller works on its own
+    // share and helps with queued tasks until everything is done.
+    template <typename T, typename F>
+    void parallel_for(thread_pool<T> &pool, std::size_t begin, std::size_t end,
+                      const F &fn, std::size_t grain=0) {
+        if (begin >= end) {
+            return;
+        }
+        auto size = end - begin;
+        auto thread_num = pool.get_thread_num();
+        if (grain == 0) {
+            grain = cal_grain(size, thread_num);
+        }
+
+        task_group<T> group(pool);
+        auto stream_num = static_cast<int>(pool.get_stream_num());
+        auto caller_stream = std::max(pool.current_stream(), 0);
+        std::size_t caller_begin = begin, caller_end = begin;
+
+        std::size_t threads_before = 0;
+        for (int s = 0; s < stream_num; s++) {
+            auto first = begin + size * threads_before / thread_num;
+            threads_before += pool.get_thread_num(s);
+            auto last = begin + size * threads_before / thread_num;
+            if (first == last) {
+                continue;
+            } else if (s == caller_stream) {
+                caller_begin = first;
+                caller_end = last;
+            } else {
+                group.run([&group, first, last, grain, s, &fn] {
+                    split_range(group, first, last, grain, s, fn);
+                }, s);
+            }
+        }
+
+        if (caller_begin != caller_end) {
+            split_range(group, caller_begin, caller_end, grain, caller_stream, fn);
+        }
+        group.wait();
+    }
+
+    // folds fn(first, last, identity) over pieces of [begin, end) with
+    // combine(a, b). Pieces are combined in range order on the caller, so
+    // the result does not depend on scheduling.
+    template <typename T, typename V, typename F, typename C>
+    V parallel_reduce(thread_pool<T> &pool, std::size_t begin, std::size_t end,
+                      V identity, const F &fn, const C &combine, std::size_t grain=0) {
+        if (begin >= end) {
+            return identity;
+        }
+        auto size = end - begin;
+        if (grain == 0) {
+            grain = cal_grain(size, pool.get_thread_num());
+        }
+
+        // wrapped so V=bool does not turn into a bit-packed vector
+        class partial {
+            public:
+                V value;
+        };
+        auto piece_num = (size + grain - 1) / grain;
+        std::vector<partial> partials(piece_num, partial{identity});
+
+        parallel_for(pool, 0, piece_num, [&](std::size_t first, std::size_t last) {
+            for (auto i = first; i < last; i++) {
+                auto piece_begin = begin + i * grain;
+                auto piece_end = std::min(piece_begin + grain, end);
+                partials[i].value = fn(piece_begin, piece_end, identity);
+            }
+        }, 1);
+
+        auto result = identity;
+        for (auto &piece : partials) {
+            result = combine(result, piece.value);
+        }
+        return result;
+    }
+
+}
+
+#endif // __HPC_PARALLEL_HPP__
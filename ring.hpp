@@ -0,0 +1,200 @@
+#pragma once
+
+#ifndef __HPC_RING_HPP__
+#define __HPC_RING_HPP__
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+#include "cpu.hpp"
+
+namespace hpc {
+
+    // bounded multi-producer multi-consumer queue after Dmitry Vyukov's
+    // design: every cell carries a sequence number telling producers and
+    // consumers whose turn it is, so push/pop cost one CAS each.
+    template <typename E>
+    class mpmc_ring {
+        public:
+            explicit mpmc_ring(std::size_t capacity=1024);
+
+            bool try_push(E item);
+            bool try_pop(E &item);
+            std::size_t try_push_bulk(const E *items, std::size_t count);
+            std::size_t try_pop_bulk(E *items, std::size_t count);
+            std::size_t size() const;
+            std::size_t capacity() const;
+            bool empty() const;
+            bool full() const;
+
+        private:
+            class cell {
+                public:
+                    std::atomic<std::size_t> sequence;
+                    E item;
+            };
+
+            std::unique_ptr<cell[]> cells;
+            std::size_t mask;
+            char pad0[CACHE_LINE_SIZE];
+            std::atomic<std::size_t> enqueue_pos;
+            char pad1[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+            std::atomic<std::size_t> dequeue_pos;
+            char pad2[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    };
+
+    template <typename E>
+    mpmc_ring<E>::mpmc_ring(std::size_t capacity) : enqueue_pos(0), dequeue_pos(0) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        this->cells.reset(new cell[size]);
+        this->mask = size - 1;
+        for (std::size_t i = 0; i < size; i++) {
+            this->cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    template <typename E>
+    bool mpmc_ring<E>::try_push(E item) {
+        auto pos = this->enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            auto &slot = this->cells[pos & this->mask];
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                if (this->enqueue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.item = item;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = this->enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    template <typename E>
+    bool mpmc_ring<E>::try_pop(E &item) {
+        auto pos = this->dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            auto &slot = this->cells[pos & this->mask];
+            auto sequence = slot.sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                // seq_cst so a producer blocked on a full ring sees the free cell
+                if (this->dequeue_pos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    item = slot.item;
+                    slot.sequence.store(pos + this->mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = this->dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Claims as many consecutive free cells as are available, up to count,
+    // with a single CAS. Returns how many items were pushed, 0 when full.
+    template <typename E>
+    std::size_t mpmc_ring<E>::try_push_bulk(const E *items, std::size_t count) {
+        auto pos = this->enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            // a cell can only stop being free once enqueue_pos moved past it,
+            // which makes the CAS below fail
+            std::size_t free = 0;
+            while (free < count && free <= this->mask) {
+                auto sequence = this->cells[(pos + free) & this->mask].sequence.load(std::memory_order_acquire);
+                if (sequence != pos + free) {
+                    break;
+                }
+                free++;
+            }
+            if (free == 0) {
+                auto sequence = this->cells[pos & this->mask].sequence.load(std::memory_order_acquire);
+                if (static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos) < 0) {
+                    return 0;
+                }
+                pos = this->enqueue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if (this->enqueue_pos.compare_exchange_weak(
+                    pos, pos + free, std::memory_order_relaxed)) {
+                for (std::size_t i = 0; i < free; i++) {
+                    auto &slot = this->cells[(pos + i) & this->mask];
+                    slot.item = items[i];
+                    slot.sequence.store(pos + i + 1, std::memory_order_release);
+                }
+                return free;
+            }
+        }
+    }
+
+    // takes up to count ready items with a single CAS, 0 when empty
+    template <typename E>
+    std::size_t mpmc_ring<E>::try_pop_bulk(E *items, std::size_t count) {
+        auto pos = this->dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            std::size_t ready = 0;
+            while (ready < count && ready <= this->mask) {
+                auto sequence = this->cells[(pos + ready) & this->mask].sequence.load(std::memory_order_acquire);
+                if (sequence != pos + ready + 1) {
+                    break;
+                }
+                ready++;
+            }
+            if (ready == 0) {
+                auto sequence = this->cells[pos & this->mask].sequence.load(std::memory_order_acquire);
+                if (static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1) < 0) {
+                    return 0;
+                }
+                pos = this->dequeue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            // seq_cst so a producer blocked on a full ring sees the free cells
+            if (this->dequeue_pos.compare_exchange_weak(
+                    pos, pos + ready, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                for (std::size_t i = 0; i < ready; i++) {
+                    auto &slot = this->cells[(pos + i) & this->mask];
+                    items[i] = slot.item;
+                    slot.sequence.store(pos + i + this->mask + 1, std::memory_order_release);
+                }
+                return ready;
+            }
+        }
+    }
+
+    // approximate while producers and consumers are active
+    template <typename E>
+    std::size_t mpmc_ring<E>::size() const {
+        auto tail = this->dequeue_pos.load(std::memory_order_seq_cst);
+        auto head = this->enqueue_pos.load(std::memory_order_seq_cst);
+        return head > tail ? head - tail : 0;
+    }
+
+    template <typename E>
+    std::size_t mpmc_ring<E>::capacity() const {
+        return this->mask + 1;
+    }
+
+    template <typename E>
+    bool mpmc_ring<E>::empty() const {
+        return this->size() == 0;
+    }
+
+    template <typename E>
+    bool mpmc_ring<E>::full() const {
+        return this->size() >= this->capacity();
+    }
+
+}
+
+#endif // __HPC_RING_HPP__
@@ -0,0 +1,273 @@
+#pragma once
+
+#ifndef __HPC_STATS_HPP__
+#define __HPC_STATS_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+// build with -DHPC_STATS=0 to compile every counter and clock sample out
+#ifndef HPC_STATS
+#define HPC_STATS 1
+#endif
+
+namespace hpc {
+
+    // log-linear buckets: values below 8 are exact, above that every power
+    // of two is split into 8 sub-buckets (at most 12.5% relative error)
+    const std::size_t HISTOGRAM_SUB_BITS = 3;
+    const std::size_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+    const std::size_t HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS;
+
+    // monotonic nanoseconds, 0 when statistics are compiled out
+    std::uint64_t stats_now() {
+    #if HPC_STATS
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    #else
+        return 0;
+    #endif
+    }
+
+    std::size_t histogram_index(std::uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return value;
+        }
+        std::size_t msb = 63 - __builtin_clzll(value);
+        std::size_t shift = msb - HISTOGRAM_SUB_BITS;
+        return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+             + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    }
+
+    // largest value that falls into bucket index
+    std::uint64_t histogram_value(std::size_t index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) {
+            return index;
+        }
+        std::size_t shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+        std::uint64_t sub = HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    // plain copy of a histogram, merged across workers on demand
+    class histogram_snapshot {
+        public:
+            std::uint64_t counts[HISTOGRAM_BUCKETS] = {};
+            std::uint64_t count = 0;
+            std::uint64_t sum = 0;
+            std::uint64_t max = 0;
+
+            void merge(const histogram_snapshot &other) {
+                for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                    this->counts[i] += other.counts[i];
+                }
+                this->count += other.count;
+                this->sum += other.sum;
+                this->max = other.max > this->max ? other.max : this->max;
+            }
+
+            double mean() const {
+                return this->count == 0 ? 0 : double(this->sum) / this->count;
+            }
+
+            // q in [0, 1], e.g. 0.99 for p99
+            std::uint64_t percentile(double q) const {
+                if (this->count == 0) {
+                    return 0;
+                }
+                auto rank = static_cast<std::uint64_t>(q * (this->count - 1)) + 1;
+                std::uint64_t seen = 0;
+                for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                    seen += this->counts[i];
+                    if (seen >= rank) {
+                        auto value = histogram_value(i);
+                        return value < this->max ? value : this->max;
+                    }
+                }
+                return this->max;
+            }
+    };
+
+    // adds value to a relaxed counter; one with a single writer gets a
+    // plain load and store instead of a locked read-modify-write
+    void add_counter(std::atomic<std::uint64_t> &counter, std::uint64_t value, bool shared) {
+        if (shared) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        } else {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+    }
+
+    // recorded with relaxed atomics, by the owning worker only unless shared
+    // is set, so the cache lines stay local and readers never block a writer
+    class histogram {
+        public:
+            void record(std::uint64_t value, bool shared) {
+                add_counter(this->counts[histogram_index(value)], 1, shared);
+                add_counter(this->count, 1, shared);
+                add_counter(this->sum, value, shared);
+                auto max = this->max.load(std::memory_order_relaxed);
+                if (!shared) {
+                    if (value > max) {
+                        this->max.store(value, std::memory_order_relaxed);
+                    }
+                    return;
+                }
+                while (value > max && !this->max.compare_exchange_weak(
+                    max, value, std::memory_order_relaxed)) {};
+            }
+
+            void snapshot(histogram_snapshot &into) const {
+                histogram_snapshot copy;
+                for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                    copy.counts[i] = this->counts[i].load(std::memory_order_relaxed);
+                }
+                copy.count = this->count.load(std::memory_order_relaxed);
+                copy.sum = this->sum.load(std::memory_order_relaxed);
+                copy.max = this->max.load(std::memory_order_relaxed);
+                into.merge(copy);
+            }
+
+            void reset() {
+                for (std::size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+                    this->counts[i].store(0, std::memory_order_relaxed);
+                }
+                this->count.store(0, std::memory_order_relaxed);
+                this->sum.store(0, std::memory_order_relaxed);
+                this->max.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            std::atomic<std::uint64_t> counts[HISTOGRAM_BUCKETS] = {};
+            std::atomic<std::uint64_t> count{0};
+            std::atomic<std::uint64_t> sum{0};
+            std::atomic<std::uint64_t> max{0};
+    };
+
+    // aggregate of any number of workers, times in nanoseconds
+    class stats_snapshot {
+        public:
+            std::uint64_t executed = 0;
+            std::uint64_t dropped = 0;
+            std::uint64_t steals = 0;
+            std::uint64_t parks = 0;
+            std::uint64_t wakeups = 0;
+            // enqueue to start of process()
+            histogram_snapshot wait;
+            // process() itself
+            histogram_snapshot run;
+            // tasks left in the stream queue and own deque when one was taken
+            histogram_snapshot depth;
+
+            void print(std::ostream &out) const {
+                out << "executed:" << this->executed
+                    << ", dropped:" << this->dropped
+                    << ", steals:" << this->steals
+                    << ", parks:" << this->parks
+                    << ", wakeups:" << this->wakeups << std::endl;
+                print(out, "wait(us)", this->wait, 1e-3);
+                print(out, "run(us)", this->run, 1e-3);
+                print(out, "depth", this->depth, 1);
+            }
+
+        private:
+            static void print(std::ostream &out, const char *name,
+                              const histogram_snapshot &h, double scale) {
+                out << name << " mean:" << h.mean() * scale
+                    << ", p50:" << h.percentile(0.5) * scale
+                    << ", p99:" << h.percentile(0.99) * scale
+                    << ", p999:" << h.percentile(0.999) * scale
+                    << ", max:" << h.max * scale << std::endl;
+            }
+    };
+
+#if HPC_STATS
+
+    // counters of one worker, or shared by all non-worker threads helping
+    // a stream; reset() is meant for a quiet pool
+    class worker_stats {
+        public:
+            explicit worker_stats(bool shared=false) : shared(shared) {}
+
+            void record_task(std::uint64_t enqueued, std::uint64_t started, std::uint64_t finished) {
+                add_counter(this->executed, 1, this->shared);
+                this->wait.record(started > enqueued ? started - enqueued : 0, this->shared);
+                this->run.record(finished > started ? finished - started : 0, this->shared);
+            }
+
+            void record_drop() {
+                add_counter(this->dropped, 1, this->shared);
+            }
+
+            void record_steal() {
+                add_counter(this->steals, 1, this->shared);
+            }
+
+            void record_park(bool signaled) {
+                add_counter(this->parks, 1, this->shared);
+                if (signaled) {
+                    add_counter(this->wakeups, 1, this->shared);
+                }
+            }
+
+            void record_depth(std::size_t depth) {
+                this->depth.record(depth, this->shared);
+            }
+
+            void snapshot(stats_snapshot &into) const {
+                into.executed += this->executed.load(std::memory_order_relaxed);
+                into.dropped += this->dropped.load(std::memory_order_relaxed);
+                into.steals += this->steals.load(std::memory_order_relaxed);
+                into.parks += this->parks.load(std::memory_order_relaxed);
+                into.wakeups += this->wakeups.load(std::memory_order_relaxed);
+                this->wait.snapshot(into.wait);
+                this->run.snapshot(into.run);
+                this->depth.snapshot(into.depth);
+            }
+
+            void reset() {
+                this->executed.store(0, std::memory_order_relaxed);
+                this->dropped.store(0, std::memory_order_relaxed);
+                this->steals.store(0, std::memory_order_relaxed);
+                this->parks.store(0, std::memory_order_relaxed);
+                this->wakeups.store(0, std::memory_order_relaxed);
+                this->wait.reset();
+                this->run.reset();
+                this->depth.reset();
+            }
+
+        private:
+            // written by several threads, not just its worker
+            bool shared;
+            std::atomic<std::uint64_t> executed{0};
+            std::atomic<std::uint64_t> dropped{0};
+            std::atomic<std::uint64_t> steals{0};
+            std::atomic<std::uint64_t> parks{0};
+            std::atomic<std::uint64_t> wakeups{0};
+            histogram wait;
+            histogram run;
+            histogram depth;
+    };
+
+#else
+
+    class worker_stats {
+        public:
+            explicit worker_stats(bool=false) {}
+
+            void record_task(std::uint64_t, std::uint64_t, std::uint64_t) {}
+            void record_drop() {}
+            void record_steal() {}
+            void record_park(bool) {}
+            void record_depth(std::size_t) {}
+            void snapshot(stats_snapshot &) const {}
+            void reset() {}
+    };
+
+#endif
+
+}
+
+#endif // __HPC_STATS_HPP__
@@ -5,7 +5,9 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
 
+#include "arena.hpp"
 #include "context.hpp"
 #include "affinity.hpp"
 #include "cpu.hpp"
@@ -20,12 +22,19 @@ namespace hpc {
             void create_threads();
             void clean_threads();
             void reset_threads();
+            void resize_threads(int thread_num);
+            int get_thread_num();
 
         private:
             static void worker(stream *, int);
+            task_base *next_task(worker_context *, bool);
+            task_base *idle(worker_context *, bool);
+            void create_workers(int thread_num);
             std::vector<std::thread> work_threads;
             std::shared_ptr<thread_context<T>> context;
-            bool terminate;
+            std::shared_ptr<stream_context<T>> queue;
+            // read by parked workers without a lock
+            std::atomic<bool> terminate;
             int thread_num;
             int id;
     };
@@ -33,26 +42,27 @@ namespace hpc {
     template <typename T>
     stream<T>::stream(std::shared_ptr<thread_context<T>> context, int id) {
         this->context = context;
+        this->queue = context->stream_contexts[id];
         this->id = id;
+        this->thread_num = 0;
         this->create_threads();
     };
 
     template <typename T>
     void stream<T>::create_threads() {
         this->terminate = false;
-        this->thread_num = this->context->affinity_infos[this->id].size();
-        for (int i = 0; i < thread_num; i++) {
-            this->work_threads.emplace_back(this->worker, this, i);
-            if (this->context->verbose) {
-                std::cout << "stream:" << this->id << ", created thread:" << i << std::endl;
-            }
+        std::size_t thread_num = 0;
+        {
+            std::lock_guard<std::mutex> lock(this->context->affinity_mt);
+            thread_num = this->context->affinity_infos[this->id].size();
         }
+        this->resize_threads(thread_num);
     }
 
     template <typename T>
     void stream<T>::clean_threads() {
         this->terminate = true;
-        this->context->condition.notify_all();
+        this->queue->idle.notify_all();
 
         for (int i = 0; i < this->work_threads.size(); i++) {
             this->work_threads[i].join();
@@ -61,6 +71,7 @@ namespace hpc {
             }
         }
         std::vector<std::thread> ().swap(this->work_threads);
+        this->thread_num = 0;
     }
 
     template <typename T>
@@ -69,40 +80,632 @@ namespace hpc {
         this->create_threads();
     }
 
+    // allocates worker contexts up to thread_num on the cores they will run
+    // on, workers of earlier threads that were retired are reused
     template <typename T>
-    void stream<T>::worker(stream *ptr, int i) {
-        set_thread_affinity(ptr->context->affinity_infos[ptr->id][i]);
+    void stream<T>::create_workers(int thread_num) {
+        auto first = static_cast<int>(this->queue->worker_count());
+        if (thread_num <= first) {
+            return;
+        }
+        std::vector<int> cores;
+        {
+            std::lock_guard<std::mutex> lock(this->context->affinity_mt);
+            auto &threads = this->context->affinity_infos[this->id];
+            for (auto i = first; i < thread_num && i < threads.size(); i++) {
+                cores.insert(cores.end(), threads[i].begin(), threads[i].end());
+            }
+        }
+        auto create = [this, first, thread_num] {
+            for (auto j = first; j < thread_num; j++) {
+                auto worker = new worker_context();
+                worker->pool = this->context.get();
+                worker->stream_id = this->id;
+                worker->thread_id = j;
+                if (this->context->trace) {
+                    worker->trace.reset(new trace_buffer(this->context->trace_capacity));
+                }
+                this->queue->workers[j].reset(worker);
+            }
+        };
+        if (cores.empty()) {
+            create();
+        } else {
+            run_on_cores(cores, create);
+        }
+        // publish only now, stealers never see a half-built worker
+        this->queue->worker_num.store(thread_num, std::memory_order_release);
+    }
+
+    // starts or retires workers until thread_num run. A retired worker
+    // finishes its current task and its deque is handed to the stream queue.
+    template <typename T>
+    void stream<T>::resize_threads(int thread_num) {
+        thread_num = std::min<int>(thread_num, this->queue->workers.size());
+        this->create_workers(thread_num);
+        for (int i = this->work_threads.size(); i < thread_num; i++) {
+            this->work_threads.emplace_back(this->worker, this, i);
+            if (this->context->verbose) {
+                std::cout << "stream:" << this->id << ", created thread:" << i << std::endl;
+            }
+        }
+
+        if (thread_num < this->work_threads.size()) {
+            for (int i = thread_num; i < this->work_threads.size(); i++) {
+                this->queue->workers[i]->retire = true;
+            }
+            this->queue->idle.notify_all();
+            for (int i = thread_num; i < this->work_threads.size(); i++) {
+                this->work_threads[i].join();
+                auto &worker = this->queue->workers[i];
+                task_base *task = nullptr;
+                while (worker->deque.steal(task)) {
+                    if (try_push(*this->queue, task)) {
+                        wake_stream(*this->queue);
+                    } else {
+                        execute_task(*this->context, task);
+                    }
+                }
+                worker->retire = false;
+                if (this->context->verbose) {
+                    std::cout << "stream:" << this->id << ", retired thread:" << i << std::endl;
+                }
+            }
+            this->work_threads.resize(thread_num);
+        }
+        this->thread_num = thread_num;
+    }
+
+    template <typename T>
+    int stream<T>::get_thread_num() {
+        return this->thread_num;
+    }
+
+    template <typename T>
+    void discard_task(thread_context<T> &context, task_base *task);
+
+    // the calling thread if it is a worker of this pool, else nullptr
+    template <typename T>
+    worker_context *pool_worker(thread_context<T> &context) {
+        auto worker = current_worker();
+        if (worker != nullptr && worker->pool == &context) {
+            return worker;
+        }
+        return nullptr;
+    }
+
+    // counters of the calling thread for a task of stream_id
+    template <typename T>
+    worker_stats &task_stats(thread_context<T> &context, int stream_id) {
+        auto worker = pool_worker(context);
+        if (worker != nullptr) {
+            return worker->stats;
+        }
+        return context.stream_contexts[stream_id]->external;
+    }
+
+    // only workers have a timeline, helping threads are not traced
+    template <typename T>
+    void trace_task(thread_context<T> &context, trace_kind kind, task_base *task, int stream_id) {
+        auto worker = pool_worker(context);
+        if (worker != nullptr && worker->trace) {
+            auto begin = kind == trace_kind::task ? task->start_time : trace_now();
+            auto end = kind == trace_kind::task ? task->finish_time : begin;
+            worker->trace->record(kind, begin, end, stream_id);
+        }
+    }
+
+    // drop the pool's reference only after run(), which may free the task
+    template <typename T>
+    void execute_task(thread_context<T> &context, task_base *task) {
+        // cancelled while queued: skipped, not searched for in the queue
+        if (task->cancelled()) {
+            discard_task(context, task);
+            return;
+        }
+        if (task->has_deadline() && std::chrono::steady_clock::now() > task->deadline) {
+            task->expired = true;
+            if (context.expiry == expiry_policy::drop) {
+                discard_task(context, task);
+                return;
+            }
+        }
+        auto holder = std::move(task->holder);
+        auto stream_id = task->stream_id;
+        task->stream_id = -1;
+        auto batch = std::move(task->batch);
+        task->run();
+        if (task->error) {
+            context.failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (task->tenant >= 0) {
+            context.tenants.finish(task);
+        } else if (context.tenants.runnable() != 0) {
+            context.tenants.charge_untagged(task);
+        }
+        task_stats(context, stream_id).record_task(
+            task->enqueue_time, task->start_time, task->finish_time);
+        if (context.trace) {
+            trace_task(context, trace_kind::task, task, stream_id);
+        }
+        task->recycle();
+        if (batch) {
+            batch->done();
+        }
+        context.stream_contexts[stream_id]->inflight.done();
+        context.inflight.done();
+    }
+
+    // completes a queued task as dropped, it will never run
+    template <typename T>
+    void discard_task(thread_context<T> &context, task_base *task) {
+        auto holder = std::move(task->holder);
+        auto stream_id = task->stream_id;
+        task->stream_id = -1;
+        auto batch = std::move(task->batch);
+        task->drop();
+        if (task->tenant >= 0) {
+            context.tenants.finish(task);
+        }
+        task_stats(context, stream_id).record_drop();
+        if (context.trace) {
+            trace_task(context, trace_kind::drop, task, stream_id);
+        }
+        task->recycle();
+        if (batch) {
+            batch->done();
+        }
+        context.stream_contexts[stream_id]->inflight.done();
+        context.inflight.done();
+    }
 
-        while (!ptr->terminate) {
-            std::unique_lock<std::mutex> lock(ptr->context->mt);
-            ptr->context->condition.wait(lock, [ptr] {
-                return (ptr->terminate || !ptr->context->queue.empty());
+    // called after publishing work, a syscall only if a worker is parked;
+    // wakes at most count of them
+    template <typename T>
+    void wake_stream(stream_context<T> &queue, int count=1) {
+        queue.idle.notify(count);
+    }
+
+    template <typename T>
+    std::size_t queue_size(stream_context<T> &queue) {
+        if (queue.prioritized) {
+            return queue.heap_size.load();
+        }
+        return queue.queue.size();
+    }
+
+    template <typename T>
+    bool is_queue_full(stream_context<T> &queue) {
+        return queue_size(queue) >= queue.capacity;
+    }
+
+    template <typename T>
+    bool try_push(stream_context<T> &queue, task_base *task) {
+        if (!queue.prioritized) {
+            return queue.queue.try_push(task);
+        }
+        std::lock_guard<std::mutex> lock(queue.heap_mt);
+        if (queue.heap.size() >= queue.capacity) {
+            return false;
+        }
+        queue.heap.push_back(queued_task{task, task->priority, task->deadline, queue.heap_sequence++});
+        std::push_heap(queue.heap.begin(), queue.heap.end(), less_urgent());
+        queue.heap_size.store(queue.heap.size());
+        return true;
+    }
+
+    // pushes a prefix of tasks in one queue operation, returns its length
+    template <typename T>
+    std::size_t try_push_bulk(stream_context<T> &queue, task_base **tasks, std::size_t count) {
+        if (!queue.prioritized) {
+            return queue.queue.try_push_bulk(tasks, count);
+        }
+        std::lock_guard<std::mutex> lock(queue.heap_mt);
+        auto pushed = std::min(count, queue.capacity - std::min(queue.capacity, queue.heap.size()));
+        for (std::size_t i = 0; i < pushed; i++) {
+            auto task = tasks[i];
+            queue.heap.push_back(queued_task{task, task->priority, task->deadline, queue.heap_sequence++});
+            std::push_heap(queue.heap.begin(), queue.heap.end(), less_urgent());
+        }
+        queue.heap_size.store(queue.heap.size());
+        return pushed;
+    }
+
+    // wakes producers parked in wait_for_space() once a slot is free
+    template <typename T>
+    void notify_space(stream_context<T> &queue) {
+        if (queue.blocked.load() > 0) {
+            { std::lock_guard<std::mutex> lock(queue.mt); }
+            queue.space.notify_all();
+        }
+    }
+
+    template <typename T>
+    bool try_pop(stream_context<T> &queue, task_base *&task) {
+        if (!queue.prioritized) {
+            if (!queue.queue.try_pop(task)) {
+                return false;
+            }
+        } else {
+            if (queue.heap_size.load(std::memory_order_relaxed) == 0) {
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(queue.heap_mt);
+            if (queue.heap.empty()) {
+                return false;
+            }
+            std::pop_heap(queue.heap.begin(), queue.heap.end(), less_urgent());
+            task = queue.heap.back().task;
+            queue.heap.pop_back();
+            queue.heap_size.store(queue.heap.size());
+        }
+        notify_space(queue);
+        return true;
+    }
+
+    // takes up to count tasks in one queue operation
+    template <typename T>
+    std::size_t try_pop_bulk(stream_context<T> &queue, task_base **tasks, std::size_t count) {
+        std::size_t popped = 0;
+        if (!queue.prioritized) {
+            popped = queue.queue.try_pop_bulk(tasks, count);
+        } else {
+            if (queue.heap_size.load(std::memory_order_relaxed) == 0) {
+                return 0;
+            }
+            std::lock_guard<std::mutex> lock(queue.heap_mt);
+            while (popped < count && !queue.heap.empty()) {
+                std::pop_heap(queue.heap.begin(), queue.heap.end(), less_urgent());
+                tasks[popped++] = queue.heap.back().task;
+                queue.heap.pop_back();
+            }
+            queue.heap_size.store(queue.heap.size());
+        }
+        if (popped != 0) {
+            notify_space(queue);
+        }
+        return popped;
+    }
+
+    // removes the task that would run last: the oldest one in a fifo ring,
+    // the least urgent one in a priority heap
+    template <typename T>
+    bool try_evict(stream_context<T> &queue, task_base *&task) {
+        if (!queue.prioritized) {
+            return try_pop(queue, task);
+        }
+        {
+            std::lock_guard<std::mutex> lock(queue.heap_mt);
+            if (queue.heap.empty()) {
+                return false;
+            }
+            auto victim = std::min_element(queue.heap.begin(), queue.heap.end(),
+                [](const queued_task &a, const queued_task &b) { return less_urgent()(b, a); });
+            task = victim->task;
+            *victim = queue.heap.back();
+            queue.heap.pop_back();
+            std::make_heap(queue.heap.begin(), queue.heap.end(), less_urgent());
+            queue.heap_size.store(queue.heap.size());
+        }
+        notify_space(queue);
+        return true;
+    }
+
+    // parks a producer until the stream queue has a free slot
+    template <typename T>
+    void wait_for_space(stream_context<T> &queue) {
+        queue.blocked.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(queue.mt);
+            queue.space.wait(lock, [&queue] {
+                return !is_queue_full(queue);
             });
+        }
+        queue.blocked.fetch_sub(1);
+    }
 
-            if (ptr->terminate) {
-                if (ptr->context->verbose) {
-                    std::cout << "stream:" << ptr->id << ", terminated worker:" << i << std::endl;
+    void note_steal(worker_context *self, task_base *task) {
+        if (self != nullptr) {
+            self->stats.record_steal();
+            if (self->trace) {
+                auto now = trace_now();
+                self->trace->record(trace_kind::steal, now, now, task->stream_id);
+            }
+        }
+    }
+
+    // takes from a stream queue on behalf of self. A work stealing worker
+    // pops a small batch in one queue operation, runs the first task and
+    // keeps the rest on its own deque, where siblings can still steal them;
+    // fifo siblings never steal, so there a batch could sit behind one long
+    // task while they park.
+    template <typename T>
+    task_base *pop_stream(thread_context<T> &context, stream_context<T> &queue, worker_context *self) {
+        task_base *task = nullptr;
+        std::size_t want = 1;
+        if (self != nullptr && context.pop_batch > 1 && !queue.prioritized
+            && context.schedule == schedule_policy::work_stealing) {
+            auto share = queue_size(queue) / std::max<std::size_t>(1, queue.worker_count());
+            want = std::max<std::size_t>(1, std::min(std::min(context.pop_batch, MAX_POP_BATCH), share));
+        }
+        if (want == 1) {
+            return try_pop(queue, task) ? task : nullptr;
+        }
+        task_base *tasks[MAX_POP_BATCH];
+        auto count = try_pop_bulk(queue, tasks, want);
+        if (count == 0) {
+            return nullptr;
+        }
+        // the deque pops newest first, push in reverse to keep queue order
+        for (auto i = count - 1; i > 0; i--) {
+            self->deque.push(tasks[i]);
+        }
+        return tasks[0];
+    }
+
+    // a task thread_pool::sync() handed to this stream, a plain load while
+    // there is none
+    template <typename T>
+    task_base *take_handoff(stream_context<T> &queue) {
+        if (queue.handoff.load(std::memory_order_relaxed) == nullptr) {
+            return nullptr;
+        }
+        return queue.handoff.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    // next task of the tenant queues, a plain load while none can start;
+    // nullptr as well when the untagged tasks of queue are owed the slot
+    template <typename T>
+    task_base *take_tenant(thread_context<T> &context, stream_context<T> &queue) {
+        if (context.tenants.runnable() == 0) {
+            return nullptr;
+        }
+        return context.tenants.pop(queue_size(queue) != 0);
+    }
+
+    // own deque, then a handed-off task, then the tenant queues, then the
+    // stream queue, then siblings, then other streams.
+    // self is nullptr for threads that are not workers of this stream.
+    template <typename T>
+    task_base *take_task(thread_context<T> &context, int stream_id, worker_context *self) {
+        task_base *task = nullptr;
+        if (self != nullptr && self->deque.pop(task)) {
+            return task;
+        }
+        task = take_handoff(*context.stream_contexts[stream_id]);
+        if (task != nullptr) {
+            return task;
+        }
+        task = take_tenant(context, *context.stream_contexts[stream_id]);
+        if (task != nullptr) {
+            return task;
+        }
+        task = pop_stream(context, *context.stream_contexts[stream_id], self);
+        if (task != nullptr) {
+            return task;
+        }
+
+        auto &siblings = context.stream_contexts[stream_id]->workers;
+        auto sibling_num = context.stream_contexts[stream_id]->worker_count();
+        auto start = self != nullptr ? self->thread_id + 1 : 0;
+        for (std::size_t k = 0; k < sibling_num; k++) {
+            auto &victim = siblings[(start + k) % sibling_num];
+            if (victim.get() != self && victim->deque.steal(task)) {
+                note_steal(self, task);
+                return task;
+            }
+        }
+
+        auto &queues = context.stream_contexts;
+        for (std::size_t s = 1; s < queues.size(); s++) {
+            auto &other = queues[(stream_id + s) % queues.size()];
+            for (std::size_t k = 0; k < other->worker_count(); k++) {
+                if (other->workers[k]->deque.steal(task)) {
+                    note_steal(self, task);
+                    return task;
                 }
-                break;
-            } else {
-                auto task = ptr->context->queue.front();
-                ptr->context->queue.pop();
-                lock.unlock();
-                task->run();
-                ptr->context->condition.notify_one();
+            }
+            if (try_pop(*other, task)) {
+                note_steal(self, task);
+                return task;
             }
         }
+        return nullptr;
+    }
+
+    // fifo workers only serve their own stream queue, their batch and the
+    // tenant queues
+    template <typename T>
+    task_base *stream<T>::next_task(worker_context *self, bool stealing) {
+        if (stealing) {
+            return take_task(*this->context, this->id, self);
+        }
+        task_base *task = nullptr;
+        if (self->deque.pop(task)) {
+            return task;
+        }
+        task = take_handoff(*this->queue);
+        if (task != nullptr) {
+            return task;
+        }
+        task = take_tenant(*this->context, *this->queue);
+        if (task != nullptr) {
+            return task;
+        }
+        return pop_stream(*this->context, *this->queue, self);
+    }
+
+    // (re)applies the cores thread_pool::resize() assigned to this worker
+    template <typename T>
+    void pin_worker(thread_context<T> &context, worker_context *self) {
+        std::vector<int> cores;
+        {
+            std::lock_guard<std::mutex> lock(context.affinity_mt);
+            self->affinity_epoch = context.affinity_epoch.load(std::memory_order_relaxed);
+            auto &threads = context.affinity_infos[self->stream_id];
+            if (self->thread_id < threads.size()) {
+                cores = threads[self->thread_id];
+            }
+        }
+        if (!cores.empty()) {
+            set_thread_affinity(cores);
+        }
+    }
+
+    // spin with pause, then yield, then park on the stream's eventcount.
+    // nullptr after a park, the caller loops and checks terminate.
+    template <typename T>
+    task_base *stream<T>::idle(worker_context *self, bool stealing) {
+        auto &budget = self->spin_budget;
+        for (auto i = 0; i < budget; i++) {
+            cpu_relax();
+            auto task = this->next_task(self, stealing);
+            if (task != nullptr) {
+                budget = std::min(budget + budget / 8 + 1, this->context->idle_spin);
+                return task;
+            }
+        }
+        for (auto i = 0; i < this->context->idle_yield; i++) {
+            std::this_thread::yield();
+            auto task = this->next_task(self, stealing);
+            if (task != nullptr) {
+                return task;
+            }
+        }
+
+        // announce the park before the last look, pairs with wake_stream()
+        auto key = this->queue->idle.prepare_wait();
+        auto task = this->next_task(self, stealing);
+        if (task != nullptr || this->terminate || self->retire) {
+            this->queue->idle.cancel_wait();
+            return task;
+        }
+        auto parked = self->trace ? trace_now() : 0;
+        auto signaled = this->queue->idle.wait(key);
+        self->stats.record_park(signaled);
+        if (self->trace) {
+            self->trace->record(trace_kind::park, parked, trace_now(), signaled);
+        }
+        budget = std::max(budget / 2, std::min(16, this->context->idle_spin));
+        return nullptr;
+    }
+
+    template <typename T>
+    void stream<T>::worker(stream *ptr, int i) {
+        auto self = ptr->queue->workers[i].get();
+        pin_worker(*ptr->context, self);
+        // pinned first, so nested post() slots come from this node
+        slot_cache::local().reserve(SLOT_RESERVE);
+
+        auto stealing = ptr->context->schedule == schedule_policy::work_stealing;
+        self->spin_budget = ptr->context->idle_spin;
+        current_worker() = self;
+
+        while (!ptr->terminate && !self->retire) {
+            if (self->affinity_epoch != ptr->context->affinity_epoch.load(std::memory_order_relaxed)) {
+                pin_worker(*ptr->context, self);
+            }
+            auto task = ptr->next_task(self, stealing);
+            if (task == nullptr) {
+                task = ptr->idle(self, stealing);
+            }
+            if (task != nullptr) {
+            #if HPC_STATS
+                self->stats.record_depth(queue_size(*ptr->queue) + self->deque.size());
+            #endif
+                execute_task(*ptr->context, task);
+            }
+        }
+
+        if (ptr->context->verbose) {
+            std::cout << "stream:" << ptr->id << ", terminated worker:" << i << std::endl;
+        }
+        current_worker() = nullptr;
+    }
+
+    // fills thread_context::core_streams from a stream layout
+    template <typename T>
+    void publish_core_streams(thread_context<T> &context,
+                              const std::vector<std::vector<std::vector<int>>> &layout) {
+        auto &topology = cpu_topology::local();
+        auto size = static_cast<int>(context.core_streams.size());
+        std::vector<int> streams(size, -1);
+        std::vector<int> node_streams(size, -1);
+        for (std::size_t i = 0; i < layout.size(); i++) {
+            for (auto &thread_cores : layout[i]) {
+                for (auto core : thread_cores) {
+                    if (core < 0 || core >= size || streams[core] >= 0) {
+                        continue;
+                    }
+                    streams[core] = i;
+                    auto node = topology.node_of(core);
+                    if (node >= 0 && node < size && node_streams[node] < 0) {
+                        node_streams[node] = i;
+                    }
+                }
+            }
+        }
+        for (auto &info : topology.cpus) {
+            if (info.cpu >= 0 && info.cpu < size && streams[info.cpu] < 0
+                && info.node >= 0 && info.node < size) {
+                streams[info.cpu] = node_streams[info.node];
+            }
+        }
+        for (auto core = 0; core < size; core++) {
+            context.core_streams[core].store(streams[core], std::memory_order_relaxed);
+        }
     }
 
     template <typename T>
     std::vector<std::shared_ptr<stream<T>>> create_streams(
         std::shared_ptr<thread_context<T>> context,
-        int stream_num, int thread_num, bool affinity) {
-        context->affinity_infos = cal_streams_affinity(
+        int stream_num, int thread_num, bool affinity,
+        int max_stream_num=0, int max_thread_num=0) {
+        auto affinity_infos = cal_streams_affinity(
             stream_num, thread_num, affinity, context->verbose);
+        std::size_t threads = 0;
+        for (auto &stream : affinity_infos) {
+            threads += stream.size();
+        }
+        auto max_threads = std::max<std::size_t>(max_thread_num, threads);
+        // a stream needs at least one thread
+        auto max_streams = std::min(std::max<std::size_t>(max_stream_num, affinity_infos.size()),
+                                    max_threads);
+
+        context->affinity = affinity;
+        context->max_thread_num = max_threads;
+        context->stream_num = affinity_infos.size();
+        affinity_infos.resize(max_streams);
+        {
+            std::lock_guard<std::mutex> lock(context->affinity_mt);
+            context->affinity_infos = affinity_infos;
+        }
+        publish_core_streams(*context, affinity_infos);
+        context->stream_contexts.clear();
+        for (auto i = 0; i < max_streams; i++) {
+            std::vector<int> cores;
+            for (auto &thread_cores : affinity_infos[i]) {
+                cores.insert(cores.end(), thread_cores.begin(), thread_cores.end());
+            }
+            // built on the stream's own cores so its ring and heap are first
+            // touched on the node its workers run on; spare streams are
+            // built wherever the pool is
+            std::shared_ptr<stream_context<T>> queue;
+            auto create = [&] {
+                queue = std::make_shared<stream_context<T>>(
+                    context->capacity, context->schedule == schedule_policy::priority);
+                queue->workers.resize(max_threads);
+            };
+            if (cores.empty()) {
+                create();
+            } else {
+                run_on_cores(cores, create);
+            }
+            context->stream_contexts.emplace_back(queue);
+        }
 
         std::vector<std::shared_ptr<stream<T>>> streams;
-        for (auto i = 0; i < context->affinity_infos.size(); i++) {
+        for (auto i = 0; i < max_streams; i++) {
             streams.emplace_back(std::make_shared<stream<T>>(context, i));
         }
         return streams;
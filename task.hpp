@@ -4,56 +4,387 @@
 #define __HPC_TASK_HPP__
 
 #include <chrono>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+
+#include "event.hpp"
 
 namespace hpc {
 
+// thrown to whoever asks for the result of a task the pool never ran
+class task_dropped : public std::runtime_error {
+    public:
+        task_dropped() : std::runtime_error("task dropped before it ran") {}
+};
+
+// handle returned by thread_pool::async_bulk(), waits for the whole batch
+class task_batch {
+    public:
+        task_batch() : counter(std::make_shared<inflight_counter>()), count(0) {}
+
+        // wait_ms == 0 waits forever
+        bool wait(double wait_ms=0) {
+            if (wait_ms == 0) {
+                this->counter->wait();
+                return true;
+            }
+            return this->counter->wait_for(wait_ms);
+        }
+
+        // tasks of the batch that have not completed yet
+        int pending() const {
+            return this->counter->load();
+        }
+
+        std::size_t size() const {
+            return this->count;
+        }
+
+        std::shared_ptr<inflight_counter> counter;
+        std::size_t count;
+};
+
+// Cancellation flag shared by copies. A child token is cancelled with its
+// parent, so cancelling a group reaches everything started under it. An
+// empty token (default constructed) is never cancelled.
+class cancellation_token {
+    public:
+        cancellation_token() = default;
+
+        static cancellation_token create() {
+            cancellation_token token;
+            token.state = std::make_shared<cancel_state>();
+            return token;
+        }
+
+        // a new token, cancelled by itself or along with this one
+        cancellation_token child() const {
+            auto token = create();
+            token.state->parent = this->state;
+            return token;
+        }
+
+        void cancel() const {
+            if (this->state) {
+                this->state->cancelled.store(true, std::memory_order_release);
+            }
+        }
+
+        // walks up to the root, cheap enough to poll inside a task
+        bool cancelled() const {
+            for (auto state = this->state.get(); state != nullptr; state = state->parent.get()) {
+                if (state->cancelled.load(std::memory_order_acquire)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool empty() const {
+            return this->state == nullptr;
+        }
+
+    private:
+        class cancel_state {
+            public:
+                std::atomic<bool> cancelled{false};
+                std::shared_ptr<cancel_state> parent;
+        };
+
+        std::shared_ptr<cancel_state> state;
+};
+
+// token of the task_group member or graph node running on this thread,
+// nullptr outside of them; new groups become its children
+const cancellation_token *&current_token() {
+    static thread_local const cancellation_token *token = nullptr;
+    return token;
+}
+
+// makes token the current one until the end of the scope
+class token_scope {
+    public:
+        explicit token_scope(const cancellation_token &token) : saved(current_token()) {
+            current_token() = &token;
+        }
+
+        ~token_scope() {
+            current_token() = this->saved;
+        }
+
+        token_scope(const token_scope &) = delete;
+        token_scope &operator=(const token_scope &) = delete;
+
+    private:
+        const cancellation_token *saved;
+};
+
+// a fresh token, linked to the current one when there is one
+cancellation_token scoped_token() {
+    auto current = current_token();
+    return current != nullptr ? current->child() : cancellation_token::create();
+}
+
+// first exception thrown by the members of a group or the nodes of a graph,
+// later ones are dropped
+class first_error {
+    public:
+        // true when error was kept
+        bool set(std::exception_ptr error) {
+            auto expected = false;
+            if (!this->taken.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) {
+                return false;
+            }
+            this->error = std::move(error);
+            return true;
+        }
+
+        // rethrows and forgets the kept exception; only once every member
+        // that could still call set() has finished
+        void rethrow() {
+            if (!this->taken.load(std::memory_order_acquire)) {
+                return;
+            }
+            auto error = std::move(this->error);
+            this->error = nullptr;
+            this->taken.store(false, std::memory_order_relaxed);
+            std::rethrow_exception(error);
+        }
+
+    private:
+        std::atomic<bool> taken{false};
+        std::exception_ptr error;
+};
+
+class task_base;
+
+// task whose process() is running on the calling thread, nullptr outside
+task_base *&running_task() {
+    static thread_local task_base *task = nullptr;
+    return task;
+}
+
+// Fields are grouped by writer: the submitter fills in the queueing fields,
+// the worker the timings, and the completion state that waiters poll comes
+// last, next to the event and continuations.
 class task_base {
     public:
-        bool status;
         double task_time;
+        // steady_clock nanoseconds: pushed to a queue, process() started and returned
+        std::uint64_t enqueue_time;
+        std::uint64_t start_time;
+        std::uint64_t finish_time;
+        // reference the pool holds while the task is queued as a raw pointer
+        std::shared_ptr<task_base> holder;
+        // completion count of the async_bulk() batch the task belongs to
+        std::shared_ptr<inflight_counter> batch;
+        // stream the pool accounted the task to, -1 when not queued
+        int stream_id;
+        // larger runs first under schedule_policy::priority
+        int priority;
+        // fair_scheduler queue the task was submitted to, -1 for none
+        int tenant;
+        // steady_clock deadline, time_point::max() when there is none
+        std::chrono::steady_clock::time_point deadline;
+        // the deadline had passed by the time a worker picked the task up
+        bool expired;
+        // checked along with cancel() before the task runs and by cancelled()
+        cancellation_token token;
+        std::atomic<bool> status;
+        // completed by drop() instead of run()
+        std::atomic<bool> dropped;
+        // thrown by process(), published by status like a result
+        std::exception_ptr error;
 
         task_base() {
             this->status = false;
+            this->dropped = false;
+            this->enqueue_time = 0;
+            this->start_time = 0;
+            this->finish_time = 0;
+            this->stream_id = -1;
+            this->priority = 0;
+            this->tenant = -1;
+            this->deadline = std::chrono::steady_clock::time_point::max();
+            this->expired = false;
+            this->cancel_requested = false;
+            this->continuations = nullptr;
+        };
+
+        virtual ~task_base() {
+            auto node = this->continuations.load(std::memory_order_acquire);
+            while (node != nullptr && node != closed()) {
+                auto next = node->next;
+                delete node;
+                node = next;
+            }
         };
 
         virtual void process() = 0;
 
+        // called by the pool once it is done with the task, pooled tasks
+        // hand their storage back here
+        virtual void recycle() {};
+
         virtual void run() final {
-            auto start = std::chrono::system_clock::now();
+            // monotonic, a wall clock step must not show up as task time
+            auto start = std::chrono::steady_clock::now();
+
+            auto outer = running_task();
+            running_task() = this;
+            try {
+                this->process();
+            } catch (...) {
+                // table based unwinding, free until something throws
+                this->error = std::current_exception();
+            }
+            running_task() = outer;
+
+            auto end = std::chrono::steady_clock::now();
+            this->start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                start.time_since_epoch()).count();
+            this->finish_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                end.time_since_epoch()).count();
+            this->task_time = double(this->finish_time - this->start_time) / 1000000;
+
+            this->status = true;
+            this->event.set();
+            this->run_continuations();
+        };
+
+        virtual void set_deadline(double deadline_ms) final {
+            this->deadline = std::chrono::steady_clock::now()
+                           + std::chrono::microseconds(static_cast<long long>(deadline_ms * 1000));
+        };
+
+        virtual bool has_deadline() final {
+            return this->deadline != std::chrono::steady_clock::time_point::max();
+        };
 
-            this->process();
+        // completes the task without calling process(), waiters wake up
+        // and find dropped set
+        virtual void drop() final {
+            this->dropped = true;
             this->status = true;
+            this->event.set();
+            this->run_continuations();
+        };
 
-            auto end = std::chrono::system_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-            this->task_time = double(duration.count())
-                            * std::chrono::microseconds::period::num
-                            / std::chrono::microseconds::period::den
-                            * 1000;
+        // completes the task with error without calling process(), used to
+        // pass a failure down a chain of continuations
+        virtual void fail(std::exception_ptr error) final {
+            this->error = std::move(error);
+            this->status = true;
+            this->event.set();
+            this->run_continuations();
         };
 
+        // process() threw, error holds the exception
+        virtual bool failed() final {
+            return this->status && this->error != nullptr;
+        };
+
+        // rethrows the exception of a failed task, nothing otherwise
+        virtual void rethrow() final {
+            if (this->status && this->error) {
+                std::rethrow_exception(this->error);
+            }
+        };
+
+        // a queued task is skipped and completes as dropped, a running one
+        // only sees it through cancelled()
+        virtual void cancel() final {
+            this->cancel_requested.store(true, std::memory_order_release);
+        };
+
+        virtual bool cancelled() final {
+            return this->cancel_requested.load(std::memory_order_acquire) || this->token.cancelled();
+        };
+
+        // wait_ms == 0 waits forever, spins briefly and then parks
         virtual bool wait(double wait_ms=0) final {
-            if (wait_ms == 0) {
-                while (!this->status) {};
+            if (this->status) {
                 return true;
-            } else {
-                auto start = std::chrono::system_clock::now();
-                while (!this->status) {
-                    auto end = std::chrono::system_clock::now();
-                    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                    auto delay_ms = double(duration.count())
-                                  * std::chrono::microseconds::period::num
-                                  / std::chrono::microseconds::period::den
-                                  * 1000;
-                    if (delay_ms >= wait_ms) {
-                        return false;
-                    }
-                };
+            } else if (wait_ms == 0) {
+                this->event.wait();
                 return true;
+            } else {
+                return this->event.wait_for(wait_ms);
             }
         };
+
+        // fn runs once after the task completes, inline on the completing
+        // thread, or right away on the caller if the task is already done.
+        // What fn throws on the completing thread is dropped, it must not
+        // unwind a worker; then() fails its own task with it instead.
+        virtual void on_complete(std::function<void()> fn) final {
+            std::unique_ptr<continuation> node(new continuation{std::move(fn), nullptr});
+            auto head = this->continuations.load(std::memory_order_acquire);
+            while (head != closed()) {
+                node->next = head;
+                if (this->continuations.compare_exchange_weak(
+                        head, node.get(), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                    node.release();
+                    return;
+                }
+            }
+            node->fn();
+        };
+
+    private:
+        class continuation {
+            public:
+                std::function<void()> fn;
+                continuation *next;
+        };
+
+        static continuation *closed() {
+            static continuation sentinel{nullptr, nullptr};
+            return &sentinel;
+        }
+
+        void run_continuations() {
+            auto node = this->continuations.exchange(closed(), std::memory_order_acq_rel);
+            // registered as a stack, run them in registration order
+            continuation *ordered = nullptr;
+            while (node != nullptr) {
+                auto next = node->next;
+                node->next = ordered;
+                ordered = node;
+                node = next;
+            }
+            while (ordered != nullptr) {
+                auto next = ordered->next;
+                try {
+                    ordered->fn();
+                } catch (...) {
+                    // see on_complete()
+                }
+                delete ordered;
+                ordered = next;
+            }
+        }
+
+        completion_event event;
+        std::atomic<continuation *> continuations;
+        std::atomic<bool> cancel_requested;
 };
 
+// polled from inside a task: the running task was cancelled, or the group
+// or graph it belongs to was
+bool cancellation_requested() {
+    auto task = running_task();
+    if (task != nullptr && task->cancelled()) {
+        return true;
+    }
+    auto token = current_token();
+    return token != nullptr && token->cancelled();
+}
+
 }
 
 #endif // __HPC_TASK_HPP__
@@ -0,0 +1,260 @@
+#pragma once
+
+#ifndef __HPC_TENANT_HPP__
+#define __HPC_TENANT_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "cpu.hpp"
+#include "stats.hpp"
+#include "task.hpp"
+
+namespace hpc {
+
+    // returned by thread_pool::add_tenant(), names a fair share queue
+    class tenant {
+        public:
+            int id = -1;
+    };
+
+    // submission queue of one tenant, guarded by the fair_scheduler mutex
+    class tenant_queue {
+        public:
+            std::string name;
+            // share of worker time relative to the other tenants
+            double weight = 1;
+            // tasks running at once, 0 for no limit
+            std::size_t max_concurrency = 0;
+            std::deque<task_base *> tasks;
+            std::size_t running = 0;
+            // share of fair_scheduler::ready this queue accounts for
+            std::size_t counted = 0;
+            // nanoseconds of process() served so far, divided by weight
+            double vtime = 0;
+            // moving average of the run time of one task, in nanoseconds
+            double estimate = 0;
+            worker_stats stats;
+
+            bool runnable() const {
+                return !this->tasks.empty()
+                    && (this->max_concurrency == 0 || this->running < this->max_concurrency);
+            }
+
+            // queued tasks that could be started right now
+            std::size_t available() const {
+                if (this->max_concurrency == 0) {
+                    return this->tasks.size();
+                }
+                if (this->running >= this->max_concurrency) {
+                    return 0;
+                }
+                return std::min(this->tasks.size(), this->max_concurrency - this->running);
+            }
+
+            // vtime once the tasks already running are charged
+            double key() const {
+                return this->vtime + this->running * this->estimate / this->weight;
+            }
+    };
+
+    // Weighted fair queuing across tenants: a worker takes the next task of
+    // the runnable tenant that has received the least worker time for its
+    // weight. Time is charged when a task finishes, and the tasks still
+    // running count at their estimated cost, so workers picking at the same
+    // time spread over tenants. A tenant that was idle restarts at the
+    // current virtual time instead of cashing in its idle period.
+    // Untagged work from the stream queues takes part as one more tenant:
+    // pop() declines when it is owed time, and its tasks are charged while
+    // tenants have work. One mutex guards the queues, workers only take it
+    // while runnable() is non-zero, capped tenants do not count there.
+    class fair_scheduler {
+        public:
+            fair_scheduler() = default;
+
+            fair_scheduler(const fair_scheduler &) = delete;
+            fair_scheduler &operator=(const fair_scheduler &) = delete;
+
+            // queued tasks that are not held back by a concurrency cap
+            std::size_t runnable() const {
+                return this->ready.load(std::memory_order_relaxed);
+            }
+
+            int add(const std::string &name, double weight, std::size_t max_concurrency) {
+                check_weight(weight);
+                std::lock_guard<std::mutex> lock(this->mt);
+                this->tenants.emplace_back(new tenant_queue());
+                auto &queue = *this->tenants.back();
+                queue.name = name;
+                queue.weight = weight;
+                queue.max_concurrency = max_concurrency;
+                queue.vtime = this->vclock;
+                return static_cast<int>(this->tenants.size() - 1);
+            }
+
+            void set(int id, double weight, std::size_t max_concurrency) {
+                check_weight(weight);
+                std::lock_guard<std::mutex> lock(this->mt);
+                auto &queue = this->at(id);
+                queue.weight = weight;
+                queue.max_concurrency = max_concurrency;
+                this->recount(queue);
+            }
+
+            void set_untagged(double weight) {
+                check_weight(weight);
+                std::lock_guard<std::mutex> lock(this->mt);
+                this->untagged_weight = weight;
+            }
+
+            // the caller has done the pool accounting, task->tenant is set here
+            void push(int id, task_base *task) {
+                std::lock_guard<std::mutex> lock(this->mt);
+                auto &queue = this->at(id);
+                if (queue.tasks.empty() && queue.running == 0) {
+                    queue.vtime = std::max(queue.vtime, this->vclock);
+                }
+                task->tenant = id;
+                queue.tasks.push_back(task);
+                this->recount(queue);
+            }
+
+            // nullptr when every tenant is empty or at its concurrency cap,
+            // or when untagged work is waiting and is owed the next slot
+            task_base *pop(bool untagged_waiting) {
+                std::lock_guard<std::mutex> lock(this->mt);
+                tenant_queue *next = nullptr;
+                for (auto &queue : this->tenants) {
+                    if (queue->runnable() && (next == nullptr || queue->key() < next->key())) {
+                        next = queue.get();
+                    }
+                }
+                if (untagged_waiting) {
+                    if (this->untagged_idle) {
+                        this->untagged_vtime = std::max(this->untagged_vtime, this->vclock);
+                        this->untagged_idle = false;
+                    }
+                    if (next == nullptr || this->untagged_vtime < next->key()) {
+                        this->vclock = std::max(this->vclock, this->untagged_vtime);
+                        return nullptr;
+                    }
+                } else {
+                    this->untagged_idle = true;
+                }
+                if (next == nullptr) {
+                    return nullptr;
+                }
+                this->vclock = std::max(this->vclock, next->key());
+                auto task = next->tasks.front();
+                next->tasks.pop_front();
+                next->running++;
+                this->recount(*next);
+                return task;
+            }
+
+            // run time of an untagged task that ran while tenants had work
+            void charge_untagged(task_base *task) {
+                double cost = task->finish_time > task->start_time ? task->finish_time - task->start_time : 0;
+                std::lock_guard<std::mutex> lock(this->mt);
+                this->untagged_vtime += cost / this->untagged_weight;
+            }
+
+            // settles a task pop() returned, after it ran or was dropped
+            void finish(task_base *task) {
+                auto id = task->tenant;
+                task->tenant = -1;
+                double cost = task->finish_time > task->start_time ? task->finish_time - task->start_time : 0;
+                std::lock_guard<std::mutex> lock(this->mt);
+                auto &queue = *this->tenants[id];
+                if (task->dropped) {
+                    queue.stats.record_drop();
+                } else {
+                    queue.stats.record_task(task->enqueue_time, task->start_time, task->finish_time);
+                }
+                queue.running--;
+                this->recount(queue);
+                if (!task->dropped) {
+                    queue.vtime += cost / queue.weight;
+                    queue.estimate = queue.estimate == 0 ? cost : queue.estimate + (cost - queue.estimate) / 8;
+                }
+            }
+
+            // takes every queued task out, they count as running so that
+            // finish() settles them like the others
+            void drain(std::vector<task_base *> &into) {
+                std::lock_guard<std::mutex> lock(this->mt);
+                for (auto &queue : this->tenants) {
+                    while (!queue->tasks.empty()) {
+                        into.push_back(queue->tasks.front());
+                        queue->tasks.pop_front();
+                        queue->running++;
+                    }
+                    this->recount(*queue);
+                }
+            }
+
+            std::size_t size() {
+                std::lock_guard<std::mutex> lock(this->mt);
+                return this->tenants.size();
+            }
+
+            void snapshot(int id, stats_snapshot &into) {
+                std::lock_guard<std::mutex> lock(this->mt);
+                this->at(id).stats.snapshot(into);
+            }
+
+            void reset_stats() {
+                std::lock_guard<std::mutex> lock(this->mt);
+                for (auto &queue : this->tenants) {
+                    queue->stats.reset();
+                }
+            }
+
+        private:
+            static void check_weight(double weight) {
+                if (!(weight > 0)) {
+                    throw std::invalid_argument("tenant weight must be positive");
+                }
+            }
+
+            // brings ready in line with what queue can start now, under mt
+            void recount(tenant_queue &queue) {
+                auto available = queue.available();
+                if (available > queue.counted) {
+                    this->ready.fetch_add(available - queue.counted);
+                } else if (available < queue.counted) {
+                    this->ready.fetch_sub(queue.counted - available, std::memory_order_relaxed);
+                }
+                queue.counted = available;
+            }
+
+            tenant_queue &at(int id) {
+                if (id < 0 || id >= static_cast<int>(this->tenants.size())) {
+                    throw std::out_of_range("tenant id out of range");
+                }
+                return *this->tenants[id];
+            }
+
+            std::atomic<std::size_t> ready{0};
+            char pad0[CACHE_LINE_SIZE];
+            std::mutex mt;
+            std::vector<std::unique_ptr<tenant_queue>> tenants;
+            // key of the latest pick
+            double vclock = 0;
+            // the stream queues, as an implicit tenant
+            double untagged_weight = 1;
+            double untagged_vtime = 0;
+            // no untagged work was waiting at the last pick
+            bool untagged_idle = true;
+    };
+
+}
+
+#endif // __HPC_TENANT_HPP__
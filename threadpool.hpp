@@ -7,119 +7,1396 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
+#include "arena.hpp"
 #include "context.hpp"
+#include "future.hpp"
 #include "stream.hpp"
+#include "timer.hpp"
 
 namespace hpc {
 
+    template <typename T>
+    class schedule_awaiter;
+
     template <typename T>
     class thread_pool {
         public:
             thread_pool(int stream_num=0, int thread_num=0,
                         bool affinity=true, bool verbose=false);
+            thread_pool(const thread_config &config);
             ~thread_pool();
 
             std::shared_ptr<T> async(std::shared_ptr<T>);
+            std::shared_ptr<T> async(std::shared_ptr<T>, int stream_id);
+            bool try_async(std::shared_ptr<T>);
+            bool try_async(std::shared_ptr<T>, int stream_id);
+            template <typename F, typename R = invoke_result_t<F>>
+            future<R> async(F &&fn);
+            template <typename F, typename R = invoke_result_t<F>>
+            future<R> async(F &&fn, int stream_id);
+            template <typename F, typename = invoke_result_t<F>>
+            void post(F &&fn);
+            template <typename F, typename = invoke_result_t<F>>
+            void post(F &&fn, int stream_id);
+            std::shared_ptr<T> async_local(std::shared_ptr<T>);
+            template <typename F, typename R = invoke_result_t<F>>
+            future<R> async_local(F &&fn);
+            tenant add_tenant(const std::string &name, double weight=1, std::size_t max_concurrency=0);
+            void set_tenant(const tenant &owner, double weight, std::size_t max_concurrency=0);
+            void set_untagged_weight(double weight);
+            std::shared_ptr<T> async(const tenant &owner, std::shared_ptr<T> task);
+            template <typename F, typename R = invoke_result_t<F>>
+            future<R> async(const tenant &owner, F &&fn);
+            template <typename Iterator>
+            task_batch async_bulk(Iterator begin, Iterator end);
+            template <typename Iterator>
+            task_batch async_bulk(Iterator begin, Iterator end, int stream_id);
+            std::shared_ptr<T> async_after(double delay_ms, std::shared_ptr<T> task, int stream_id=-1);
+            std::shared_ptr<T> async_at(std::chrono::steady_clock::time_point when,
+                                        std::shared_ptr<T> task, int stream_id=-1);
+            template <typename F, typename R = invoke_result_t<F>>
+            future<R> async_after(double delay_ms, F &&fn, int stream_id=-1);
+            template <typename F, typename R = invoke_result_t<F>>
+            future<R> async_at(std::chrono::steady_clock::time_point when, F &&fn, int stream_id=-1);
+            timer_handle async_every(double period_ms, std::shared_ptr<T> task, int stream_id=-1);
+            template <typename F, typename = invoke_result_t<F>>
+            timer_handle async_every(double period_ms, F &&fn, int stream_id=-1);
+            schedule_awaiter<T> schedule();
+            schedule_awaiter<T> schedule(int stream_id);
             bool wait(std::shared_ptr<T>, double timeout=0);
             bool sync(std::shared_ptr<T>, bool direct=true);
+            bool sync(std::shared_ptr<T>, sync_policy policy);
             void wait_all();
+            void wait_stream(int stream_id);
             void clean_all();
             void reset_all();
+            bool try_run_one();
+            int current_stream();
+            int local_stream();
+            int stream_of_core(int core);
+            int stream_of_node(int node);
+            std::size_t get_stream_num();
+            std::size_t get_thread_num();
+            std::size_t get_thread_num(int stream_id);
+            void resize(int stream_num, int thread_num);
+            stats_snapshot stats();
+            stats_snapshot stats(int stream_id);
+            stats_snapshot stats(const tenant &owner);
+            void reset_stats();
+            std::uint64_t failures();
+            void dump_trace(std::ostream &out);
+            void clear_trace();
 
         private:
+            std::size_t select_stream();
+            worker_context *local_worker();
+            bool enqueue(task_base *task, overflow_policy policy);
+            bool enqueue(task_base *task, int stream_id, overflow_policy policy);
+            void enqueue_bulk(task_base **tasks, std::size_t count, int stream_id, overflow_policy policy);
+            bool push_task(stream_context<T> &queue, task_base *task, overflow_policy policy);
+            template <typename Iterator>
+            task_batch prepare_bulk(Iterator begin, Iterator end, std::vector<task_base *> &tasks);
+            void check_tenant(const tenant &owner);
+            void enqueue_tenant(const tenant &owner, task_base *task);
+            void run_inline(std::shared_ptr<T> task, int stream_id);
+            bool try_handoff(std::shared_ptr<T> task);
+            void help_until(task_base &task);
+            void check_stream(int stream_id);
+            void migrate_stream(int stream_id);
+            void resize_locked(int stream_num, int thread_num);
+            void autoscale();
+            std::uint64_t timer_ticks(std::chrono::steady_clock::time_point when, bool round_up);
+            void add_timer(timer_entry *entry);
+            timer_handle add_periodic(double period_ms, int stream_id, std::function<void()> body);
+            void run_timers();
+            void fire_timers(std::vector<timer_entry *> &due);
+            void clear_timers();
+            void resume_timers();
             std::vector<std::shared_ptr<stream<T>>> streams;
             std::shared_ptr<thread_context<T>> context;
+            thread_config config;
+            // serializes resize(), clean_all() and reset_all()
+            std::mutex resize_mt;
+            // stream_num last asked for, 0 lets the layout follow the nodes
+            int requested_streams;
+            std::thread scaler;
+            std::mutex scaler_mt;
+            std::condition_variable scaler_cv;
+            bool scaler_stop = false;
+            // started by the first timer, sleeps until the next tick that is due
+            std::thread timer;
+            std::mutex timer_mt;
+            std::condition_variable timer_cv;
+            timer_wheel wheel;
+            std::chrono::steady_clock::time_point timer_origin;
+            // tick the timer thread sleeps until, 0 while it is awake
+            std::uint64_t timer_wake = 0;
+            bool timer_stop = false;
+            // due entries taken off the wheel are being queued right now
+            bool timer_firing = false;
+            // held by clean_all(), nothing fires until it has drained the pool
+            bool timer_paused = false;
+    };
+
+    // Posted to resume a suspended coroutine. If the pool drops it instead
+    // of running it, the coroutine is still resumed, on the dropping
+    // thread, with *dropped set so its awaiter throws task_dropped; the
+    // frame is not leaked and whoever waits on it gets the error.
+    template <typename Handle>
+    class resume_task {
+        public:
+            resume_task(Handle handle, bool *dropped) : handle(handle), dropped(dropped) {}
+
+            resume_task(resume_task &&other) noexcept : handle(other.handle), dropped(other.dropped) {
+                other.handle = nullptr;
+            }
+
+            resume_task(const resume_task &) = delete;
+            resume_task &operator=(const resume_task &) = delete;
+
+            ~resume_task() {
+                if (this->handle) {
+                    *this->dropped = true;
+                    this->handle.resume();
+                }
+            }
+
+            void operator()() {
+                auto handle = this->handle;
+                this->handle = nullptr;
+                handle.resume();
+            }
+
+        private:
+            Handle handle;
+            bool *dropped;
+    };
+
+    // co_await pool.schedule() suspends the coroutine and resumes it on a
+    // worker, the handle is queued like any posted callable
+    template <typename T>
+    class schedule_awaiter {
+        public:
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            // a resume_task the pool refuses has already resumed the
+            // coroutine with dropped set when post() throws, and the frame
+            // may be gone by now: nothing of this is touched after that
+            template <typename Handle>
+            void await_suspend(Handle handle) {
+                try {
+                    if (this->stream_id < 0) {
+                        this->pool.post(resume_task<Handle>(handle, &this->dropped));
+                    } else {
+                        this->pool.post(resume_task<Handle>(handle, &this->dropped), this->stream_id);
+                    }
+                } catch (...) {}
+            }
+
+            // the pool dropped the resume, e.g. in clean_all()
+            void await_resume() const {
+                if (this->dropped) {
+                    throw task_dropped();
+                }
+            }
+
+            thread_pool<T> &pool;
+            int stream_id;
+            bool dropped = false;
     };
 
     template <typename T>
     thread_pool<T>::thread_pool(int stream_num, int thread_num,
-                                bool affinity, bool verbose) {
+                                bool affinity, bool verbose)
+        : thread_pool(thread_config{stream_num, thread_num, affinity, verbose}) {}
+
+    template <typename T>
+    thread_pool<T>::thread_pool(const thread_config &config) {
         this->context = std::make_shared<thread_context<T>>();
-        this->context->verbose = verbose;
-        this->streams = create_streams(this->context, stream_num, thread_num, affinity);
+        this->context->verbose = config.verbose;
+        this->context->dispatch = config.dispatch;
+        this->context->schedule = config.schedule;
+        this->context->capacity = config.capacity;
+        this->context->overflow = config.overflow;
+        this->context->expiry = config.expiry;
+        this->context->idle_spin = config.idle_spin;
+        this->context->idle_yield = config.idle_yield;
+        this->context->pop_batch = config.pop_batch;
+        this->context->trace = config.trace;
+        this->context->trace_capacity = config.trace_capacity;
+        this->context->trace_epoch = trace_now();
+        this->timer_origin = std::chrono::steady_clock::now();
+        this->config = config;
+        this->requested_streams = config.stream_num;
+        this->streams = create_streams(this->context, config.stream_num,
+                                       config.thread_num, config.affinity,
+                                       config.max_stream_num, config.max_thread_num);
+        if (config.autoscale) {
+            this->scaler = std::thread(&thread_pool::autoscale, this);
+        }
     }
 
     template <typename T>
     thread_pool<T>::~thread_pool() {
+        if (this->scaler.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(this->scaler_mt);
+                this->scaler_stop = true;
+            }
+            this->scaler_cv.notify_all();
+            this->scaler.join();
+        }
+        if (this->timer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(this->timer_mt);
+                this->timer_stop = true;
+            }
+            this->timer_cv.notify_all();
+            this->timer.join();
+        }
         this->clean_all();
     }
 
     template <typename T>
-    std::shared_ptr<T> thread_pool<T>::async(std::shared_ptr<T> task) {
-        {
-            std::lock_guard<std::mutex> lock(this->context->mt);
-            this->context->queue.push(task);
+    std::size_t thread_pool<T>::select_stream() {
+        auto &queues = this->context->stream_contexts;
+        auto stream_num = this->context->stream_num.load(std::memory_order_relaxed);
+        if (this->context->dispatch == dispatch_policy::least_loaded) {
+            // start from a rotating index so ties do not all land on stream 0
+            auto start = this->context->next_stream.fetch_add(1, std::memory_order_relaxed);
+            auto best = start % stream_num;
+            auto best_load = queue_size(*queues[best]);
+            for (std::size_t i = 1; i < stream_num && best_load != 0; i++) {
+                auto idx = (start + i) % stream_num;
+                auto load = queue_size(*queues[idx]);
+                if (load < best_load) {
+                    best = idx;
+                    best_load = load;
+                }
+            }
+            return best;
+        } else {
+            return this->context->next_stream.fetch_add(1, std::memory_order_relaxed) % stream_num;
         }
-        this->context->condition.notify_one();
-        return task;
     }
 
+    // worker of this pool the caller runs on, if it owns a stealable deque
     template <typename T>
-    bool thread_pool<T>::wait(std::shared_ptr<T> task, double timeout) {
-        if (timeout == 0) {
-            while (task->status != true) {};
+    worker_context *thread_pool<T>::local_worker() {
+        auto worker = current_worker();
+        if (worker != nullptr && worker->pool == this->context.get()
+            && this->context->schedule == schedule_policy::work_stealing) {
+            return worker;
+        }
+        return nullptr;
+    }
+
+    template <typename T>
+    void thread_pool<T>::check_stream(int stream_id) {
+        if (stream_id < 0 || stream_id >= this->context->stream_num.load(std::memory_order_relaxed)) {
+            throw std::out_of_range("stream id out of range");
+        }
+    }
+
+    // the caller has already set task->holder
+    template <typename T>
+    bool thread_pool<T>::enqueue(task_base *task, overflow_policy policy) {
+        auto worker = this->local_worker();
+        auto stream_id = worker != nullptr ? worker->stream_id : this->select_stream();
+        return this->enqueue(task, stream_id, policy);
+    }
+
+    // false only for overflow_policy::reject, the task is then released
+    // untouched and the caller still owns it
+    template <typename T>
+    bool thread_pool<T>::enqueue(task_base *task, int stream_id, overflow_policy policy) {
+        auto &queue = this->context->stream_contexts[stream_id];
+        task->stream_id = stream_id;
+        task->enqueue_time = stats_now();
+        queue->inflight.add();
+        this->context->inflight.add();
+
+        auto worker = this->local_worker();
+        if (worker != nullptr && worker->stream_id == stream_id) {
+            // nested submission from one of our workers: lock-free local push
+            worker->deque.push(task);
+            wake_stream(*queue);
+            if (stream_id >= this->context->stream_num.load(std::memory_order_relaxed)) {
+                this->migrate_stream(stream_id);
+            }
             return true;
-        } else {
-            auto start = std::chrono::system_clock::now();
-            double block_time = 0;
-            while (task->status != true && block_time < timeout) {
-                auto end = std::chrono::system_clock::now();
-                auto duration =
-                    std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-                block_time = double(duration.count())
-                            * std::chrono::microseconds::period::num
-                            / std::chrono::microseconds::period::den
-                            * 1000;
-            };
-            if (task->status) {
+        }
+
+        if (!this->push_task(*queue, task, policy)) {
+            auto holder = std::move(task->holder);
+            task->stream_id = -1;
+            task->recycle();
+            queue->inflight.done();
+            this->context->inflight.done();
+            return false;
+        }
+        // the fence in wake_stream() pairs with the one in resize(): either
+        // resize() migrates this task or we see the stream retired here
+        wake_stream(*queue);
+        if (stream_id >= this->context->stream_num.load(std::memory_order_relaxed)) {
+            this->migrate_stream(stream_id);
+        }
+        return true;
+    }
+
+    // applies the overflow policy until the task is queued or has run;
+    // false only for overflow_policy::reject, the task is then not queued
+    template <typename T>
+    bool thread_pool<T>::push_task(stream_context<T> &queue, task_base *task, overflow_policy policy) {
+        while (!try_push(queue, task)) {
+            if (policy == overflow_policy::reject) {
+                return false;
+            } else if (policy == overflow_policy::caller_runs) {
+                execute_task(*this->context, task);
                 return true;
+            } else if (policy == overflow_policy::drop_oldest) {
+                task_base *oldest = nullptr;
+                if (try_evict(queue, oldest)) {
+                    discard_task(*this->context, oldest);
+                }
+            } else if (this->current_stream() >= 0) {
+                // a worker must not sleep on its own pool, help drain it instead
+                if (!this->try_run_one()) {
+                    std::this_thread::yield();
+                }
             } else {
-                return false;
+                wait_for_space(queue);
             }
         }
+        return true;
     }
 
+    // one accounting update, one queue operation and one wakeup per run of
+    // tasks that fits; the remainder goes through the overflow policy, where
+    // reject completes the tasks as dropped since part of the batch is queued
     template <typename T>
-    bool thread_pool<T>::sync(std::shared_ptr<T> task, bool direct) {
-        if (direct) {
-            task->run();
-            return true;
+    void thread_pool<T>::enqueue_bulk(task_base **tasks, std::size_t count,
+                                      int stream_id, overflow_policy policy) {
+        auto &queue = this->context->stream_contexts[stream_id];
+        auto now = stats_now();
+        for (std::size_t i = 0; i < count; i++) {
+            tasks[i]->stream_id = stream_id;
+            tasks[i]->enqueue_time = now;
+        }
+        queue->inflight.add(count);
+        this->context->inflight.add(count);
+
+        auto worker = this->local_worker();
+        if (worker != nullptr && worker->stream_id == stream_id) {
+            for (std::size_t i = count; i > 0; i--) {
+                worker->deque.push(tasks[i - 1]);
+            }
+            wake_stream(*queue, count);
         } else {
-            return this->wait(this->async(task));
+            std::size_t queued = 0;
+            while (queued < count) {
+                auto pushed = try_push_bulk(*queue, tasks + queued, count - queued);
+                if (pushed != 0) {
+                    wake_stream(*queue, pushed);
+                    queued += pushed;
+                    continue;
+                }
+                if (this->push_task(*queue, tasks[queued], policy)) {
+                    wake_stream(*queue);
+                } else {
+                    discard_task(*this->context, tasks[queued]);
+                }
+                queued++;
+            }
+        }
+        if (stream_id >= this->context->stream_num.load(std::memory_order_relaxed)) {
+            this->migrate_stream(stream_id);
         }
     }
 
+    // moves the tasks of a retired stream to the streams still running
     template <typename T>
-    void thread_pool<T>::wait_all() {
-        {
-            std::unique_lock<std::mutex> lock(this->context->mt);
-            while (!this->context->queue.empty()) {
+    void thread_pool<T>::migrate_stream(int stream_id) {
+        auto &queue = this->context->stream_contexts[stream_id];
+        auto move = [this, &queue](task_base *task) {
+            // account to the new stream before releasing the old one, the
+            // pool wide count must not touch zero in between
+            this->enqueue(task, overflow_policy::block);
+            queue->inflight.done();
+            this->context->inflight.done();
+        };
+        task_base *task = take_handoff(*queue);
+        if (task != nullptr) {
+            move(task);
+        }
+        while (try_pop(*queue, task)) {
+            move(task);
+        }
+        for (std::size_t i = 0; i < queue->worker_count(); i++) {
+            while (queue->workers[i]->deque.steal(task)) {
+                move(task);
+            }
+        }
+    }
+
+    template <typename T>
+    std::shared_ptr<T> thread_pool<T>::async(std::shared_ptr<T> task) {
+        task->holder = task;
+        if (!this->enqueue(task.get(), this->context->overflow)) {
+            throw queue_full();
+        }
+        return task;
+    }
+
+    template <typename T>
+    std::shared_ptr<T> thread_pool<T>::async(std::shared_ptr<T> task, int stream_id) {
+        this->check_stream(stream_id);
+        task->holder = task;
+        if (!this->enqueue(task.get(), stream_id, this->context->overflow)) {
+            throw queue_full();
+        }
+        return task;
+    }
+
+    // never blocks, false when the stream queue is full
+    template <typename T>
+    bool thread_pool<T>::try_async(std::shared_ptr<T> task) {
+        task->holder = task;
+        return this->enqueue(task.get(), overflow_policy::reject);
+    }
+
+    template <typename T>
+    bool thread_pool<T>::try_async(std::shared_ptr<T> task, int stream_id) {
+        this->check_stream(stream_id);
+        task->holder = task;
+        return this->enqueue(task.get(), stream_id, overflow_policy::reject);
+    }
+
+    template <typename T>
+    template <typename F, typename R>
+    future<R> thread_pool<T>::async(F &&fn) {
+        auto result = make_function_future<R>(std::forward<F>(fn));
+        auto task = result.task();
+        task->holder = task;
+        if (!this->enqueue(task.get(), this->context->overflow)) {
+            throw queue_full();
+        }
+        return result;
+    }
+
+    template <typename T>
+    template <typename F, typename R>
+    future<R> thread_pool<T>::async(F &&fn, int stream_id) {
+        this->check_stream(stream_id);
+        auto result = make_function_future<R>(std::forward<F>(fn));
+        auto task = result.task();
+        task->holder = task;
+        if (!this->enqueue(task.get(), stream_id, this->context->overflow)) {
+            throw queue_full();
+        }
+        return result;
+    }
+
+    // fire-and-forget submission, the callable is stored in a recycled slot
+    template <typename T>
+    template <typename F, typename>
+    void thread_pool<T>::post(F &&fn) {
+        if (!this->enqueue(pooled_task::create(std::forward<F>(fn)), this->context->overflow)) {
+            throw queue_full();
+        }
+    }
+
+    template <typename T>
+    template <typename F, typename>
+    void thread_pool<T>::post(F &&fn, int stream_id) {
+        this->check_stream(stream_id);
+        if (!this->enqueue(pooled_task::create(std::forward<F>(fn)), stream_id,
+                           this->context->overflow)) {
+            throw queue_full();
+        }
+    }
+
+    // a fair share queue served by the workers of every stream, see
+    // fair_scheduler. Untagged tasks of the stream queues share the workers
+    // with the tenants as one more tenant of weight set_untagged_weight(),
+    // nested tasks on a worker's own deque still run first;
+    // max_concurrency 0 means no cap.
+    template <typename T>
+    tenant thread_pool<T>::add_tenant(const std::string &name, double weight, std::size_t max_concurrency) {
+        tenant owner;
+        owner.id = this->context->tenants.add(name, weight, max_concurrency);
+        return owner;
+    }
+
+    template <typename T>
+    void thread_pool<T>::set_tenant(const tenant &owner, double weight, std::size_t max_concurrency) {
+        this->check_tenant(owner);
+        this->context->tenants.set(owner.id, weight, max_concurrency);
+    }
+
+    template <typename T>
+    void thread_pool<T>::set_untagged_weight(double weight) {
+        this->context->tenants.set_untagged(weight);
+    }
+
+    template <typename T>
+    std::shared_ptr<T> thread_pool<T>::async(const tenant &owner, std::shared_ptr<T> task) {
+        this->check_tenant(owner);
+        task->holder = task;
+        this->enqueue_tenant(owner, task.get());
+        return task;
+    }
+
+    template <typename T>
+    template <typename F, typename R>
+    future<R> thread_pool<T>::async(const tenant &owner, F &&fn) {
+        this->check_tenant(owner);
+        auto result = make_function_future<R>(std::forward<F>(fn));
+        auto task = result.task();
+        task->holder = task;
+        this->enqueue_tenant(owner, task.get());
+        return result;
+    }
+
+    template <typename T>
+    void thread_pool<T>::check_tenant(const tenant &owner) {
+        if (owner.id < 0 || owner.id >= static_cast<int>(this->context->tenants.size())) {
+            throw std::out_of_range("tenant id out of range");
+        }
+    }
+
+    // accounted to a stream like any other task, but the tenant queue has
+    // no capacity limit and a worker of any stream may pick the task up,
+    // so a parked worker is woken wherever there is one
+    template <typename T>
+    void thread_pool<T>::enqueue_tenant(const tenant &owner, task_base *task) {
+        auto worker = this->local_worker();
+        auto stream_id = worker != nullptr ? worker->stream_id : this->select_stream();
+        auto &queue = this->context->stream_contexts[stream_id];
+        task->stream_id = stream_id;
+        task->enqueue_time = stats_now();
+        queue->inflight.add();
+        this->context->inflight.add();
+        this->context->tenants.push(owner.id, task);
+        // pairs with the waiter count a parking worker publishes before its
+        // last look at the queues
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto stream_num = static_cast<int>(this->context->stream_num.load(std::memory_order_relaxed));
+        for (auto k = 0; k < stream_num; k++) {
+            auto &parked = this->context->stream_contexts[(stream_id + k) % stream_num];
+            if (parked->idle.waiting() != 0) {
+                wake_stream(*parked);
+                return;
+            }
+        }
+    }
+
+    // the task is queued once delay_ms has passed; until then it counts
+    // as inflight for wait_all() and clean_all() completes it as dropped
+    template <typename T>
+    std::shared_ptr<T> thread_pool<T>::async_after(double delay_ms, std::shared_ptr<T> task, int stream_id) {
+        return this->async_at(std::chrono::steady_clock::now()
+                              + std::chrono::microseconds(static_cast<long long>(delay_ms * 1000)),
+                              std::move(task), stream_id);
+    }
+
+    template <typename T>
+    std::shared_ptr<T> thread_pool<T>::async_at(std::chrono::steady_clock::time_point when,
+                                                std::shared_ptr<T> task, int stream_id) {
+        if (stream_id >= 0) {
+            this->check_stream(stream_id);
+        }
+        task->holder = task;
+        auto entry = new timer_entry();
+        entry->due = this->timer_ticks(when, true);
+        entry->stream_id = stream_id;
+        entry->task = task.get();
+        this->add_timer(entry);
+        return task;
+    }
+
+    template <typename T>
+    template <typename F, typename R>
+    future<R> thread_pool<T>::async_after(double delay_ms, F &&fn, int stream_id) {
+        return this->async_at(std::chrono::steady_clock::now()
+                              + std::chrono::microseconds(static_cast<long long>(delay_ms * 1000)),
+                              std::forward<F>(fn), stream_id);
+    }
+
+    template <typename T>
+    template <typename F, typename R>
+    future<R> thread_pool<T>::async_at(std::chrono::steady_clock::time_point when, F &&fn, int stream_id) {
+        if (stream_id >= 0) {
+            this->check_stream(stream_id);
+        }
+        auto result = make_function_future<R>(std::forward<F>(fn));
+        auto task = result.task();
+        task->holder = task;
+        auto entry = new timer_entry();
+        entry->due = this->timer_ticks(when, true);
+        entry->stream_id = stream_id;
+        entry->task = task.get();
+        this->add_timer(entry);
+        return result;
+    }
+
+    // calls task->process() every period_ms, first after one period. A run
+    // is skipped while the previous one has not returned; the task itself
+    // never completes, so it can be waited on only through its own state.
+    template <typename T>
+    timer_handle thread_pool<T>::async_every(double period_ms, std::shared_ptr<T> task, int stream_id) {
+        return this->add_periodic(period_ms, stream_id, [task] { task->process(); });
+    }
+
+    template <typename T>
+    template <typename F, typename>
+    timer_handle thread_pool<T>::async_every(double period_ms, F &&fn, int stream_id) {
+        return this->add_periodic(period_ms, stream_id, std::forward<F>(fn));
+    }
+
+    template <typename T>
+    timer_handle thread_pool<T>::add_periodic(double period_ms, int stream_id, std::function<void()> body) {
+        if (stream_id >= 0) {
+            this->check_stream(stream_id);
+        }
+        auto state = std::make_shared<timer_state>();
+        state->body = std::move(body);
+        auto now = std::chrono::steady_clock::now();
+        auto period = std::chrono::microseconds(static_cast<long long>(period_ms * 1000));
+        auto entry = new timer_entry();
+        entry->due = this->timer_ticks(now + period, true);
+        entry->period = std::max<std::uint64_t>(1, this->timer_ticks(this->timer_origin + period, false));
+        entry->stream_id = stream_id;
+        entry->state = state;
+        this->add_timer(entry);
+        return timer_handle(state);
+    }
+
+    // ticks since the pool was created, rounded up for due times so a
+    // timer never fires early
+    template <typename T>
+    std::uint64_t thread_pool<T>::timer_ticks(std::chrono::steady_clock::time_point when, bool round_up) {
+        if (when <= this->timer_origin) {
+            return 0;
+        }
+        auto tick = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(this->config.timer_tick * 1000000));
+        auto ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            when - this->timer_origin).count());
+        return round_up ? (ns + tick - 1) / tick : ns / tick;
+    }
+
+    template <typename T>
+    void thread_pool<T>::add_timer(timer_entry *entry) {
+        if (entry->period == 0) {
+            this->context->inflight.add();
+        }
+        std::lock_guard<std::mutex> lock(this->timer_mt);
+        if (!this->timer.joinable()) {
+            this->timer = std::thread(&thread_pool::run_timers, this);
+        }
+        if (this->wheel.size() == 0) {
+            // an empty wheel is not advanced while the timer thread sleeps
+            std::vector<timer_entry *> none;
+            this->wheel.advance(this->timer_ticks(std::chrono::steady_clock::now(), false), none);
+        }
+        this->wheel.add(entry);
+        if (entry->due < this->timer_wake) {
+            this->timer_wake = 0;
+            this->timer_cv.notify_all();
+        }
+    }
+
+    template <typename T>
+    void thread_pool<T>::run_timers() {
+        std::vector<timer_entry *> due;
+        std::unique_lock<std::mutex> lock(this->timer_mt);
+        while (!this->timer_stop) {
+            if (this->timer_paused) {
+                this->timer_cv.wait(lock);
+                continue;
+            }
+            this->wheel.advance(this->timer_ticks(std::chrono::steady_clock::now(), false), due);
+            if (!due.empty()) {
+                this->timer_firing = true;
                 lock.unlock();
+                this->fire_timers(due);
+                due.clear();
                 lock.lock();
-            };
+                this->timer_firing = false;
+                this->timer_cv.notify_all();
+                continue;
+            }
+            this->timer_wake = this->wheel.next_due();
+            if (this->timer_wake == UINT64_MAX) {
+                this->timer_cv.wait(lock);
+            } else {
+                auto tick = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(this->config.timer_tick * 1000000));
+                this->timer_cv.wait_until(lock, this->timer_origin + std::chrono::nanoseconds(this->timer_wake * tick));
+            }
+            this->timer_wake = 0;
+        }
+    }
+
+    // due tasks are grouped per stream and each group is queued with one
+    // enqueue_bulk(), periodic timers are put back for their next period
+    template <typename T>
+    void thread_pool<T>::fire_timers(std::vector<timer_entry *> &due) {
+        auto stream_num = this->context->stream_num.load();
+        std::vector<std::vector<task_base *>> batches(this->context->stream_contexts.size());
+        std::vector<timer_entry *> rearm;
+        int one_shots = 0;
+        auto now = this->timer_ticks(std::chrono::steady_clock::now(), false);
+        for (auto entry : due) {
+            auto task = entry->task;
+            auto stream_id = entry->stream_id;
+            if (entry->period != 0) {
+                auto state = entry->state;
+                if (state->cancelled.load(std::memory_order_acquire)) {
+                    delete entry;
+                    continue;
+                }
+                task = nullptr;
+                if (!state->busy.exchange(true, std::memory_order_acquire)) {
+                    task = pooled_task::create([state] {
+                        try {
+                            state->body();
+                        } catch (...) {
+                            // counted as a failure, the next period still runs
+                            state->busy.store(false, std::memory_order_release);
+                            throw;
+                        }
+                        state->busy.store(false, std::memory_order_release);
+                    });
+                }
+                // fixed rate, periods missed while the thread was late are skipped
+                while (entry->due <= now) {
+                    entry->due += entry->period;
+                }
+                rearm.push_back(entry);
+            } else {
+                one_shots++;
+                delete entry;
+            }
+            if (task != nullptr) {
+                // a stream retired since the timer was set falls back to any stream
+                if (stream_id < 0 || stream_id >= stream_num) {
+                    stream_id = this->select_stream();
+                }
+                batches[stream_id].push_back(task);
+            }
+        }
+        for (std::size_t i = 0; i < batches.size(); i++) {
+            if (!batches[i].empty()) {
+                this->enqueue_bulk(batches[i].data(), batches[i].size(), i, this->context->overflow);
+            }
+        }
+        // queued above, no longer waiting on the wheel
+        if (one_shots != 0) {
+            this->context->inflight.done(one_shots);
+        }
+        if (!rearm.empty()) {
+            std::lock_guard<std::mutex> lock(this->timer_mt);
+            for (auto entry : rearm) {
+                this->wheel.add(entry);
+            }
+        }
+    }
+
+    // one-shot timers complete as dropped, periodic ones are cancelled.
+    // Waits out a round that is being queued and keeps the timer thread
+    // from firing until resume_timers(), so nothing it queues can land
+    // behind the drain of clean_all()
+    template <typename T>
+    void thread_pool<T>::clear_timers() {
+        std::vector<timer_entry *> entries;
+        {
+            std::unique_lock<std::mutex> lock(this->timer_mt);
+            this->timer_paused = true;
+            this->timer_cv.wait(lock, [this] { return !this->timer_firing; });
+            this->wheel.clear(entries);
+        }
+        for (auto entry : entries) {
+            if (entry->period == 0) {
+                auto holder = std::move(entry->task->holder);
+                entry->task->drop();
+                entry->task->recycle();
+                this->context->inflight.done();
+            } else {
+                entry->state->cancelled.store(true, std::memory_order_release);
+            }
+            delete entry;
+        }
+    }
+
+    // timers added while clean_all() ran fire from here on
+    template <typename T>
+    void thread_pool<T>::resume_timers() {
+        {
+            std::lock_guard<std::mutex> lock(this->timer_mt);
+            this->timer_paused = false;
+        }
+        this->timer_cv.notify_all();
+    }
+
+    // queued on local_stream(), e.g. to keep a lookup on the socket whose
+    // shard of a cache the caller is already touching
+    template <typename T>
+    std::shared_ptr<T> thread_pool<T>::async_local(std::shared_ptr<T> task) {
+        return this->async(std::move(task), this->local_stream());
+    }
+
+    template <typename T>
+    template <typename F, typename R>
+    future<R> thread_pool<T>::async_local(F &&fn) {
+        return this->async(std::forward<F>(fn), this->local_stream());
+    }
+
+    template <typename T>
+    schedule_awaiter<T> thread_pool<T>::schedule() {
+        return schedule_awaiter<T>{*this, -1};
+    }
+
+    template <typename T>
+    schedule_awaiter<T> thread_pool<T>::schedule(int stream_id) {
+        this->check_stream(stream_id);
+        return schedule_awaiter<T>{*this, stream_id};
+    }
+
+    // holds every task and ties it to one batch counter
+    template <typename T>
+    template <typename Iterator>
+    task_batch thread_pool<T>::prepare_bulk(Iterator begin, Iterator end,
+                                            std::vector<task_base *> &tasks) {
+        task_batch batch;
+        for (auto it = begin; it != end; ++it) {
+            std::shared_ptr<T> task = *it;
+            task->holder = task;
+            task->batch = batch.counter;
+            tasks.push_back(task.get());
+        }
+        batch.count = tasks.size();
+        batch.counter->add(tasks.size());
+        return batch;
+    }
+
+    // submits a range of std::shared_ptr<T> split evenly across the streams,
+    // each share in a single queue operation; a work-stealing worker keeps
+    // the whole range on its own deque
+    template <typename T>
+    template <typename Iterator>
+    task_batch thread_pool<T>::async_bulk(Iterator begin, Iterator end) {
+        std::vector<task_base *> tasks;
+        auto batch = this->prepare_bulk(begin, end, tasks);
+        if (tasks.empty()) {
+            return batch;
+        }
+        auto worker = this->local_worker();
+        if (worker != nullptr) {
+            this->enqueue_bulk(tasks.data(), tasks.size(), worker->stream_id, this->context->overflow);
+            return batch;
+        }
+        auto stream_num = std::min(this->context->stream_num.load(), tasks.size());
+        auto first = this->select_stream();
+        for (std::size_t s = 0; s < stream_num; s++) {
+            auto from = tasks.size() * s / stream_num;
+            auto to = tasks.size() * (s + 1) / stream_num;
+            this->enqueue_bulk(tasks.data() + from, to - from, (first + s) % stream_num,
+                               this->context->overflow);
+        }
+        return batch;
+    }
+
+    template <typename T>
+    template <typename Iterator>
+    task_batch thread_pool<T>::async_bulk(Iterator begin, Iterator end, int stream_id) {
+        this->check_stream(stream_id);
+        std::vector<task_base *> tasks;
+        auto batch = this->prepare_bulk(begin, end, tasks);
+        if (!tasks.empty()) {
+            this->enqueue_bulk(tasks.data(), tasks.size(), stream_id, this->context->overflow);
+        }
+        return batch;
+    }
+
+    template <typename T>
+    bool thread_pool<T>::wait(std::shared_ptr<T> task, double timeout) {
+        if (!task->wait(timeout)) {
+            return false;
+        }
+        task->rethrow();
+        return true;
+    }
+
+    template <typename T>
+    bool thread_pool<T>::sync(std::shared_ptr<T> task, bool direct) {
+        return this->sync(std::move(task), direct ? sync_policy::direct : sync_policy::queued);
+    }
+
+    // returns once the task has completed and rethrows what its process()
+    // threw; a waiting caller runs other queued tasks instead of sleeping,
+    // so a worker syncing on its own saturated pool still makes progress
+    template <typename T>
+    bool thread_pool<T>::sync(std::shared_ptr<T> task, sync_policy policy) {
+        if (policy == sync_policy::direct) {
+            task->run();
+            task->rethrow();
+            return true;
+        }
+        if (policy == sync_policy::adaptive) {
+            auto worker = pool_worker(*this->context);
+            if (worker != nullptr) {
+                this->run_inline(task, worker->stream_id);
+                task->rethrow();
+                return true;
+            }
+            if (this->try_handoff(task)) {
+                this->help_until(*task);
+                task->rethrow();
+                return true;
+            }
+        }
+        this->async(task);
+        this->help_until(*task);
+        task->rethrow();
+        return true;
+    }
+
+    // accounted and traced like a queued task, but run on the caller
+    template <typename T>
+    void thread_pool<T>::run_inline(std::shared_ptr<T> task, int stream_id) {
+        auto &queue = this->context->stream_contexts[stream_id];
+        task->holder = task;
+        task->stream_id = stream_id;
+        task->enqueue_time = stats_now();
+        queue->inflight.add();
+        this->context->inflight.add();
+        execute_task(*this->context, task.get());
+    }
+
+    // passes the task to a stream that has parked workers and nothing
+    // queued, starting from the caller's own; false when none is idle
+    template <typename T>
+    bool thread_pool<T>::try_handoff(std::shared_ptr<T> task) {
+        auto stream_num = static_cast<int>(this->context->stream_num.load(std::memory_order_relaxed));
+        auto start = this->local_stream();
+        for (auto k = 0; k < stream_num; k++) {
+            auto stream_id = (start + k) % stream_num;
+            auto &queue = this->context->stream_contexts[stream_id];
+            if (queue->idle.waiting() == 0 || queue_size(*queue) != 0
+                || queue->handoff.load(std::memory_order_relaxed) != nullptr) {
+                continue;
+            }
+            task->holder = task;
+            task->stream_id = stream_id;
+            task->enqueue_time = stats_now();
+            queue->inflight.add();
+            this->context->inflight.add();
+            task_base *expected = nullptr;
+            if (queue->handoff.compare_exchange_strong(expected, task.get(), std::memory_order_release,
+                                                       std::memory_order_relaxed)) {
+                // same handshake with resize() as enqueue()
+                wake_stream(*queue);
+                if (stream_id >= this->context->stream_num.load(std::memory_order_relaxed)) {
+                    this->migrate_stream(stream_id);
+                }
+                return true;
+            }
+            task->holder.reset();
+            task->stream_id = -1;
+            queue->inflight.done();
+            this->context->inflight.done();
+        }
+        return false;
+    }
+
+    template <typename T>
+    void thread_pool<T>::help_until(task_base &task) {
+        while (!task.status) {
+            if (!this->try_run_one()) {
+                // nothing queued to help with, the task is already running
+                task.wait();
+            }
         }
     }
 
+    // returns once every queued and running task has finished
+    template <typename T>
+    void thread_pool<T>::wait_all() {
+        this->context->inflight.wait();
+    }
+
+    template <typename T>
+    void thread_pool<T>::wait_stream(int stream_id) {
+        this->context->stream_contexts.at(stream_id)->inflight.wait();
+    }
+
     template <typename T>
     void thread_pool<T>::clean_all() {
+        this->clear_timers();
+        std::lock_guard<std::mutex> lock(this->resize_mt);
         for (auto &stream : this->streams) {
             stream->clean_threads();
         }
-        {
-            std::lock_guard<std::mutex> lock(this->context->mt);
-            this->context->queue = std::queue<std::shared_ptr<T>>();
+        // workers are joined, whatever is still queued completes as dropped
+        task_base *task = nullptr;
+        for (auto &queue : this->context->stream_contexts) {
+            task = take_handoff(*queue);
+            if (task != nullptr) {
+                discard_task(*this->context, task);
+            }
+            while (try_pop(*queue, task)) {
+                discard_task(*this->context, task);
+            }
+            for (std::size_t i = 0; i < queue->worker_count(); i++) {
+                while (queue->workers[i]->deque.pop(task)) {
+                    discard_task(*this->context, task);
+                }
+            }
+            { std::lock_guard<std::mutex> lock(queue->mt); }
+            queue->space.notify_all();
+        }
+        std::vector<task_base *> waiting;
+        this->context->tenants.drain(waiting);
+        for (auto queued : waiting) {
+            discard_task(*this->context, queued);
         }
+        this->resume_timers();
     }
 
     template <typename T>
     void thread_pool<T>::reset_all() {
         this->clean_all();
+        std::lock_guard<std::mutex> lock(this->resize_mt);
         for (auto &stream : this->streams) {
             stream->create_threads();
         }
     }
 
+    // runs one queued task on the calling thread, false if none was found
+    template <typename T>
+    bool thread_pool<T>::try_run_one() {
+        auto worker = current_worker();
+        task_base *task = nullptr;
+        if (worker != nullptr && worker->pool == this->context.get()) {
+            task = take_task(*this->context, worker->stream_id, this->local_worker());
+        } else {
+            task = take_task(*this->context, this->select_stream(), nullptr);
+        }
+        if (task == nullptr) {
+            return false;
+        }
+        execute_task(*this->context, task);
+        return true;
+    }
+
+    // stream of the calling worker, -1 for threads outside this pool
+    template <typename T>
+    int thread_pool<T>::current_stream() {
+        auto worker = current_worker();
+        if (worker != nullptr && worker->pool == this->context.get()) {
+            return worker->stream_id;
+        }
+        return -1;
+    }
+
+    // stream closest to the calling thread: its own for a worker, else the
+    // one owning the cpu it runs on, else one on the same NUMA node, else
+    // whatever the dispatch policy picks
+    template <typename T>
+    int thread_pool<T>::local_stream() {
+        auto stream_id = this->current_stream();
+        if (stream_id >= 0) {
+            return stream_id;
+        }
+        stream_id = this->stream_of_core(sched_getcpu());
+        return stream_id >= 0 ? stream_id : static_cast<int>(this->select_stream());
+    }
+
+    // stream whose workers own core, or one on the core's NUMA node; -1
+    // when no active stream is on that node
+    template <typename T>
+    int thread_pool<T>::stream_of_core(int core) {
+        auto &streams = this->context->core_streams;
+        if (core < 0 || core >= static_cast<int>(streams.size())) {
+            return -1;
+        }
+        auto stream_id = streams[core].load(std::memory_order_relaxed);
+        if (stream_id >= static_cast<int>(this->context->stream_num.load(std::memory_order_relaxed))) {
+            return -1;
+        }
+        return stream_id;
+    }
+
+    // a stream with cores on NUMA node, -1 when there is none
+    template <typename T>
+    int thread_pool<T>::stream_of_node(int node) {
+        for (auto &info : cpu_topology::local().cpus) {
+            if (info.node == node) {
+                auto stream_id = this->stream_of_core(info.cpu);
+                if (stream_id >= 0) {
+                    return stream_id;
+                }
+            }
+        }
+        return -1;
+    }
+
+    template <typename T>
+    std::size_t thread_pool<T>::get_stream_num() {
+        return this->context->stream_num.load();
+    }
+
+    template <typename T>
+    std::size_t thread_pool<T>::get_thread_num() {
+        std::lock_guard<std::mutex> lock(this->context->affinity_mt);
+        std::size_t thread_num = 0;
+        for (auto &stream : this->context->affinity_infos) {
+            thread_num += stream.size();
+        }
+        return thread_num;
+    }
+
+    template <typename T>
+    std::size_t thread_pool<T>::get_thread_num(int stream_id) {
+        std::lock_guard<std::mutex> lock(this->context->affinity_mt);
+        return this->context->affinity_infos.at(stream_id).size();
+    }
+
+    // Changes the layout online, arguments as for the constructor and capped
+    // by thread_config::max_stream_num / max_thread_num. Affinity is
+    // recomputed and running workers re-pin themselves; retired streams hand
+    // their queued tasks to the remaining ones, nothing is dropped.
+    template <typename T>
+    void thread_pool<T>::resize(int stream_num, int thread_num) {
+        std::lock_guard<std::mutex> lock(this->resize_mt);
+        this->requested_streams = stream_num;
+        this->resize_locked(stream_num, thread_num);
+    }
+
+    template <typename T>
+    void thread_pool<T>::resize_locked(int stream_num, int thread_num) {
+        auto &context = *this->context;
+        auto max_streams = static_cast<int>(this->streams.size());
+        if (thread_num <= 0) {
+            thread_num = cal_parallel_cores(context.affinity).size();
+        }
+        thread_num = std::min<int>(thread_num, context.max_thread_num);
+        auto layout = cal_streams_affinity(std::min(stream_num, max_streams), thread_num,
+                                           context.affinity, context.verbose);
+        if (layout.size() > max_streams) {
+            layout = cal_streams_affinity(max_streams, thread_num, context.affinity, context.verbose);
+        }
+        int old_num = context.stream_num.load();
+        int new_num = layout.size();
+        layout.resize(max_streams);
+
+        // retire streams: stop routing to them first, then join their workers
+        if (new_num < old_num) {
+            context.stream_num.store(new_num);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (auto i = new_num; i < old_num; i++) {
+                this->streams[i]->clean_threads();
+            }
+        }
+        // shrink before the new layout is published, so no worker looks up
+        // cores past the end of its stream
+        for (auto i = 0; i < std::min(new_num, old_num); i++) {
+            if (layout[i].size() < this->streams[i]->get_thread_num()) {
+                this->streams[i]->resize_threads(layout[i].size());
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(context.affinity_mt);
+            context.affinity_infos = layout;
+            context.affinity_epoch.fetch_add(1);
+            publish_core_streams(context, layout);
+        }
+        for (auto i = 0; i < std::min(new_num, old_num); i++) {
+            if (layout[i].size() > this->streams[i]->get_thread_num()) {
+                this->streams[i]->resize_threads(layout[i].size());
+            }
+        }
+        for (auto i = old_num; i < new_num; i++) {
+            this->streams[i]->create_threads();
+        }
+        if (new_num > old_num) {
+            context.stream_num.store(new_num);
+        }
+        for (auto i = new_num; i < old_num; i++) {
+            this->migrate_stream(i);
+        }
+    }
+
+    // samples queue depth and parked workers every autoscale_interval:
+    // grows by a quarter while queues stay deep, retires one thread after
+    // a long stretch of empty queues with parked workers
+    template <typename T>
+    void thread_pool<T>::autoscale() {
+        auto busy = 0;
+        auto idle = 0;
+        auto interval = std::chrono::microseconds(
+            static_cast<long long>(this->config.autoscale_interval * 1000));
+        std::unique_lock<std::mutex> lock(this->scaler_mt);
+        while (!this->scaler_cv.wait_for(lock, interval, [this] { return this->scaler_stop; })) {
+            std::size_t depth = 0;
+            std::size_t parked = 0;
+            auto stream_num = this->context->stream_num.load();
+            for (std::size_t i = 0; i < stream_num; i++) {
+                auto &queue = this->context->stream_contexts[i];
+                depth += queue_size(*queue);
+                for (std::size_t j = 0; j < queue->worker_count(); j++) {
+                    depth += queue->workers[j]->deque.size();
+                }
+                parked += queue->idle.waiting();
+            }
+            auto threads = static_cast<int>(this->get_thread_num());
+            if (depth > threads * this->config.autoscale_depth) {
+                busy++;
+                idle = 0;
+            } else if (depth == 0 && parked > 0) {
+                idle++;
+                busy = 0;
+            } else {
+                busy = 0;
+                idle = 0;
+            }
+
+            auto target = threads;
+            if (busy >= this->config.autoscale_grow) {
+                target = std::min<int>(threads + std::max(1, threads / 4), this->context->max_thread_num);
+            } else if (idle >= this->config.autoscale_shrink) {
+                target = std::max(threads - 1, std::max(1, this->config.min_thread_num));
+            }
+            if (target != threads) {
+                busy = 0;
+                idle = 0;
+                std::lock_guard<std::mutex> resize_lock(this->resize_mt);
+                this->resize_locked(this->requested_streams, target);
+                if (this->context->verbose) {
+                    std::cout << "autoscale: threads " << threads << " -> " << target << std::endl;
+                }
+            }
+        }
+    }
+
+    // tasks run by the workers whose process() threw since the pool
+    // started, kept with HPC_STATS=0 as well; the exception itself stays
+    // with the task for whoever waits on it
+    template <typename T>
+    std::uint64_t thread_pool<T>::failures() {
+        return this->context->failed.load(std::memory_order_relaxed);
+    }
+
+    // counters and latency histograms summed over every worker of the pool,
+    // empty when built with HPC_STATS=0
+    template <typename T>
+    stats_snapshot thread_pool<T>::stats() {
+        stats_snapshot snapshot;
+        for (auto &queue : this->context->stream_contexts) {
+            for (std::size_t i = 0; i < queue->worker_count(); i++) {
+                queue->workers[i]->stats.snapshot(snapshot);
+            }
+            queue->external.snapshot(snapshot);
+        }
+        return snapshot;
+    }
+
+    template <typename T>
+    stats_snapshot thread_pool<T>::stats(int stream_id) {
+        this->check_stream(stream_id);
+        stats_snapshot snapshot;
+        auto &queue = this->context->stream_contexts[stream_id];
+        for (std::size_t i = 0; i < queue->worker_count(); i++) {
+            queue->workers[i]->stats.snapshot(snapshot);
+        }
+        queue->external.snapshot(snapshot);
+        return snapshot;
+    }
+
+    // counters and histograms of the tasks submitted to one tenant
+    template <typename T>
+    stats_snapshot thread_pool<T>::stats(const tenant &owner) {
+        this->check_tenant(owner);
+        stats_snapshot snapshot;
+        this->context->tenants.snapshot(owner.id, snapshot);
+        return snapshot;
+    }
+
+    template <typename T>
+    void thread_pool<T>::reset_stats() {
+        for (auto &queue : this->context->stream_contexts) {
+            for (std::size_t i = 0; i < queue->worker_count(); i++) {
+                queue->workers[i]->stats.reset();
+            }
+            queue->external.reset();
+        }
+        this->context->tenants.reset_stats();
+    }
+
+    // Chrome trace JSON (chrome://tracing, ui.perfetto.dev): one process per
+    // stream, one thread lane per worker named after its cores. Call it on an
+    // idle pool, e.g. after wait_all(); needs thread_config::trace.
+    template <typename T>
+    void thread_pool<T>::dump_trace(std::ostream &out) {
+        auto &queues = this->context->stream_contexts;
+        auto separator = "\n";
+        out << "{\"traceEvents\":[";
+        for (std::size_t i = 0; i < queues.size(); i++) {
+            out << separator << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << i
+                << ",\"args\":{\"name\":\"stream " << i << "\"}}";
+            separator = ",\n";
+            out << separator << "{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":" << i
+                << ",\"args\":{\"sort_index\":" << i << "}}";
+            for (std::size_t j = 0; j < queues[i]->worker_count(); j++) {
+                auto &worker = queues[i]->workers[j];
+                out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << i
+                    << ",\"tid\":" << worker->thread_id << ",\"args\":{\"name\":\"worker "
+                    << worker->thread_id << " cores";
+                {
+                    // retired workers keep their events but have no cores
+                    std::lock_guard<std::mutex> lock(this->context->affinity_mt);
+                    auto &threads = this->context->affinity_infos[i];
+                    if (j < threads.size()) {
+                        for (auto core : threads[j]) {
+                            out << " " << core;
+                        }
+                    }
+                }
+                out << "\"";
+                if (!worker->trace) {
+                    out << "}}";
+                    continue;
+                }
+                // events lost to the ring wrapping, raise trace_capacity if nonzero
+                out << ",\"overwritten\":" << worker->trace->overwritten() << "}}";
+                for (auto &event : worker->trace->events()) {
+                    out << separator;
+                    write_trace_event(out, event, i, worker->thread_id, this->context->trace_epoch);
+                }
+            }
+        }
+        out << "\n],\"displayTimeUnit\":\"ns\"}" << std::endl;
+    }
+
+    template <typename T>
+    void thread_pool<T>::clear_trace() {
+        for (auto &queue : this->context->stream_contexts) {
+            for (std::size_t i = 0; i < queue->worker_count(); i++) {
+                if (queue->workers[i]->trace) {
+                    queue->workers[i]->trace->clear();
+                }
+            }
+        }
+    }
+
 }
 
 #endif // __HPC_THREAD_POOL_HPP__
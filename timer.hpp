@@ -0,0 +1,183 @@
+#pragma once
+
+#ifndef __HPC_TIMER_HPP__
+#define __HPC_TIMER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include "task.hpp"
+
+namespace hpc {
+
+    // shared by the wheel entry of a periodic timer and its handle
+    class timer_state {
+        public:
+            std::function<void()> body;
+            std::atomic<bool> cancelled{false};
+            // the previous run has not returned yet, the next one is skipped
+            std::atomic<bool> busy{false};
+    };
+
+    // returned by thread_pool::async_every(), cancel() stops further runs
+    // but lets a run that already started finish
+    class timer_handle {
+        public:
+            timer_handle() = default;
+            explicit timer_handle(std::shared_ptr<timer_state> state) : state(std::move(state)) {}
+
+            void cancel() {
+                if (this->state) {
+                    this->state->cancelled.store(true, std::memory_order_release);
+                }
+            }
+
+            bool cancelled() const {
+                return !this->state || this->state->cancelled.load(std::memory_order_acquire);
+            }
+
+        private:
+            std::shared_ptr<timer_state> state;
+    };
+
+    class timer_entry {
+        public:
+            // tick at which the entry is due
+            std::uint64_t due = 0;
+            // -1 lets the pool pick a stream
+            int stream_id = -1;
+            // one-shot timers: queued as is, holder already set
+            task_base *task = nullptr;
+            // periodic timers: period in ticks, 0 for one-shot timers
+            std::uint64_t period = 0;
+            std::shared_ptr<timer_state> state;
+            timer_entry *next = nullptr;
+    };
+
+    const std::size_t TIMER_SLOT_BITS = 6;
+    const std::size_t TIMER_SLOTS = 1 << TIMER_SLOT_BITS;
+    const std::size_t TIMER_LEVELS = 4;
+
+    // Hierarchical timing wheel: level l has TIMER_SLOTS slots of
+    // TIMER_SLOTS^l ticks each. Adding is O(1), and an entry moves down a
+    // level each time the level below wraps around, so it is touched at
+    // most TIMER_LEVELS times. Entries past the top level are parked in its
+    // last slot and placed again when it is reached. Not thread safe.
+    class timer_wheel {
+        public:
+            std::uint64_t now() const {
+                return this->current;
+            }
+
+            std::size_t size() const {
+                return this->count;
+            }
+
+            void add(timer_entry *entry) {
+                this->count++;
+                this->place(entry);
+            }
+
+            // moves the wheel forward to tick and appends every entry due by then
+            void advance(std::uint64_t tick, std::vector<timer_entry *> &due) {
+                this->take(this->expired, due);
+                while (this->current < tick && this->count != 0) {
+                    this->current++;
+                    for (auto level = TIMER_LEVELS - 1; level > 0; level--) {
+                        auto shift = TIMER_SLOT_BITS * level;
+                        if ((this->current & ((std::uint64_t(1) << shift) - 1)) == 0) {
+                            this->cascade(level, (this->current >> shift) & (TIMER_SLOTS - 1));
+                        }
+                    }
+                    this->take(this->slots[0][this->current & (TIMER_SLOTS - 1)], due);
+                    this->take(this->expired, due);
+                }
+                if (this->current < tick) {
+                    // nothing left to cascade, jump straight there
+                    this->current = tick;
+                }
+            }
+
+            // earliest tick advance() may have something to do, the next
+            // level 1 wrap when the lowest level is empty
+            std::uint64_t next_due() const {
+                if (this->count == 0) {
+                    return UINT64_MAX;
+                }
+                if (this->expired != nullptr) {
+                    return this->current;
+                }
+                auto wrap = ((this->current >> TIMER_SLOT_BITS) + 1) << TIMER_SLOT_BITS;
+                for (std::uint64_t tick = this->current + 1; tick < wrap; tick++) {
+                    if (this->slots[0][tick & (TIMER_SLOTS - 1)] != nullptr) {
+                        return tick;
+                    }
+                }
+                return wrap;
+            }
+
+            // removes every entry, due or not
+            void clear(std::vector<timer_entry *> &entries) {
+                this->take(this->expired, entries);
+                for (auto &level : this->slots) {
+                    for (auto &slot : level) {
+                        this->take(slot, entries);
+                    }
+                }
+            }
+
+        private:
+            void place(timer_entry *entry) {
+                if (entry->due <= this->current) {
+                    entry->next = this->expired;
+                    this->expired = entry;
+                    return;
+                }
+                auto delta = entry->due - this->current;
+                auto target = entry->due;
+                std::size_t level = 0;
+                while (level + 1 < TIMER_LEVELS && delta >= (std::uint64_t(1) << (TIMER_SLOT_BITS * (level + 1)))) {
+                    level++;
+                }
+                auto span = std::uint64_t(1) << (TIMER_SLOT_BITS * TIMER_LEVELS);
+                if (delta >= span) {
+                    target = this->current + span - 1;
+                }
+                auto &slot = this->slots[level][(target >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+                entry->next = slot;
+                slot = entry;
+            }
+
+            void cascade(std::size_t level, std::size_t index) {
+                auto entry = this->slots[level][index];
+                this->slots[level][index] = nullptr;
+                while (entry != nullptr) {
+                    auto next = entry->next;
+                    this->place(entry);
+                    entry = next;
+                }
+            }
+
+            void take(timer_entry *&list, std::vector<timer_entry *> &into) {
+                while (list != nullptr) {
+                    auto entry = list;
+                    list = entry->next;
+                    entry->next = nullptr;
+                    into.push_back(entry);
+                    this->count--;
+                }
+            }
+
+            timer_entry *slots[TIMER_LEVELS][TIMER_SLOTS] = {};
+            // due at or before current
+            timer_entry *expired = nullptr;
+            std::uint64_t current = 0;
+            std::size_t count = 0;
+    };
+
+}
+
+#endif // __HPC_TIMER_HPP__
@@ -0,0 +1,203 @@
+#pragma once
+
+#ifndef __HPC_TOPOLOGY_HPP__
+#define __HPC_TOPOLOGY_HPP__
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+
+namespace hpc {
+
+    const int MAX_CACHE_INDEX = 8;
+
+    // one logical cpu as seen in /sys/devices/system/cpu/cpuN
+    class cpu_info {
+        public:
+            int cpu = 0;
+            int socket = 0;
+            int node = 0;
+            // index of the physical core across the whole machine
+            int core = 0;
+            // 0 for the first hardware thread of a core, 1 for its SMT sibling...
+            int smt_index = 0;
+            // lowest cpu sharing the cache, -1 when unknown
+            int l2_group = -1;
+            int l3_group = -1;
+    };
+
+    // parses the kernel cpu list format, e.g. "0-3,8,10-11"
+    std::vector<int> parse_cpu_list(const std::string &list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            auto dash = range.find('-');
+            try {
+                if (dash == std::string::npos) {
+                    cpus.emplace_back(std::stoi(range));
+                } else {
+                    auto first = std::stoi(range.substr(0, dash));
+                    auto last = std::stoi(range.substr(dash + 1));
+                    for (auto cpu = first; cpu <= last; cpu++) {
+                        cpus.emplace_back(cpu);
+                    }
+                }
+            } catch (const std::exception &) {
+                // blank or malformed entry, skip it
+            }
+        }
+        return cpus;
+    }
+
+    // Machine layout read straight from sysfs: sockets, NUMA nodes, physical
+    // cores, SMT siblings and L2/L3 sharing. root is normally
+    // /sys/devices/system, it can point at a copied or fake tree instead.
+    class cpu_topology {
+        public:
+            std::vector<cpu_info> cpus;
+            int socket_num = 1;
+            int node_num = 1;
+            int core_num = 0;
+
+            explicit cpu_topology(const std::string &root="/sys/devices/system");
+
+            static const cpu_topology &local() {
+                static cpu_topology topology;
+                return topology;
+            }
+
+            const cpu_info *find(int cpu) const {
+                for (auto &info : this->cpus) {
+                    if (info.cpu == cpu) {
+                        return &info;
+                    }
+                }
+                return nullptr;
+            }
+
+            int node_of(int cpu) const {
+                auto info = this->find(cpu);
+                return info != nullptr ? info->node : 0;
+            }
+
+        private:
+            static bool read_line(const std::string &path, std::string &line) {
+                std::ifstream file(path);
+                return file && std::getline(file, line);
+            }
+
+            static int read_int(const std::string &path, int fallback) {
+                std::string line;
+                if (!read_line(path, line)) {
+                    return fallback;
+                }
+                try {
+                    return std::stoi(line);
+                } catch (const std::exception &) {
+                    return fallback;
+                }
+            }
+
+            static int cache_group(const std::string &cpu_dir, int level, int cpu) {
+                for (int index = 0; index < MAX_CACHE_INDEX; index++) {
+                    auto dir = cpu_dir + "/cache/index" + std::to_string(index);
+                    auto cache_level = read_int(dir + "/level", -1);
+                    if (cache_level < 0) {
+                        continue;
+                    }
+                    std::string type;
+                    read_line(dir + "/type", type);
+                    if (cache_level == level && type != "Instruction") {
+                        std::string shared;
+                        if (!read_line(dir + "/shared_cpu_list", shared)) {
+                            return cpu;
+                        }
+                        auto sharing = parse_cpu_list(shared);
+                        return sharing.empty() ? cpu : *std::min_element(sharing.begin(), sharing.end());
+                    }
+                }
+                return -1;
+            }
+    };
+
+    cpu_topology::cpu_topology(const std::string &root) {
+        std::string line;
+        std::vector<int> online;
+        if (read_line(root + "/cpu/online", line)) {
+            online = parse_cpu_list(line);
+        }
+        if (online.empty()) {
+            // no sysfs: one socket, one node, every cpu its own core
+            int count = std::max(1u, std::thread::hardware_concurrency());
+            for (int cpu = 0; cpu < count; cpu++) {
+                cpu_info info;
+                info.cpu = cpu;
+                info.core = cpu;
+                this->cpus.emplace_back(info);
+            }
+            this->core_num = count;
+            return;
+        }
+
+        std::map<int, int> cpu_nodes;
+        std::vector<int> nodes;
+        if (read_line(root + "/node/online", line)) {
+            nodes = parse_cpu_list(line);
+        }
+        for (auto node : nodes) {
+            if (read_line(root + "/node/node" + std::to_string(node) + "/cpulist", line)) {
+                for (auto cpu : parse_cpu_list(line)) {
+                    cpu_nodes[cpu] = node;
+                }
+            }
+        }
+
+        std::map<std::pair<int, int>, int> core_ids;
+        std::set<int> sockets, node_ids;
+        for (auto cpu : online) {
+            auto dir = root + "/cpu/cpu" + std::to_string(cpu);
+            cpu_info info;
+            info.cpu = cpu;
+            info.socket = std::max(0, read_int(dir + "/topology/physical_package_id", 0));
+            auto core_id = read_int(dir + "/topology/core_id", cpu);
+
+            // core_id is only unique inside a package
+            auto key = std::make_pair(info.socket, core_id);
+            if (core_ids.find(key) == core_ids.end()) {
+                auto next = static_cast<int>(core_ids.size());
+                core_ids[key] = next;
+            }
+            info.core = core_ids[key];
+
+            std::vector<int> siblings;
+            if (read_line(dir + "/topology/thread_siblings_list", line)) {
+                siblings = parse_cpu_list(line);
+            }
+            auto position = std::find(siblings.begin(), siblings.end(), cpu);
+            info.smt_index = position != siblings.end() ? position - siblings.begin() : 0;
+
+            // without NUMA information a socket is the best guess for a node
+            auto node = cpu_nodes.find(cpu);
+            info.node = node != cpu_nodes.end() ? node->second : info.socket;
+            info.l2_group = cache_group(dir, 2, cpu);
+            info.l3_group = cache_group(dir, 3, cpu);
+
+            sockets.insert(info.socket);
+            node_ids.insert(info.node);
+            this->cpus.emplace_back(info);
+        }
+
+        this->socket_num = sockets.size();
+        this->node_num = node_ids.size();
+        this->core_num = core_ids.size();
+    }
+
+}
+
+#endif // __HPC_TOPOLOGY_HPP__
@@ -0,0 +1,121 @@
+#pragma once
+
+#ifndef __HPC_TRACE_HPP__
+#define __HPC_TRACE_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <iostream>
+
+namespace hpc {
+
+    // steady_clock nanoseconds, independent of HPC_STATS
+    std::uint64_t trace_now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    enum class trace_kind : std::uint32_t {
+        task,   // process() of a task, arg is the stream it was queued on
+        drop,   // task completed as dropped, arg is its stream
+        steal,  // task taken from a sibling or another stream, arg is its stream
+        park,   // worker asleep on its stream, arg is 1 when woken by a signal
+    };
+
+    // steady_clock nanoseconds, begin == end for instant events
+    class trace_event {
+        public:
+            std::uint64_t begin;
+            std::uint64_t end;
+            trace_kind kind;
+            std::int32_t arg;
+    };
+
+    // Single-writer ring of the latest events of one worker. The owner
+    // appends without locks or atomics read-modify-writes and overwrites the
+    // oldest entries once full; events() is only meant for a quiescent pool.
+    class trace_buffer {
+        public:
+            explicit trace_buffer(std::size_t capacity) {
+                std::size_t size = 1;
+                while (size < capacity) {
+                    size <<= 1;
+                }
+                this->events_.resize(size);
+                this->mask = size - 1;
+            }
+
+            void record(trace_kind kind, std::uint64_t begin, std::uint64_t end, std::int32_t arg) {
+                auto count = this->count.load(std::memory_order_relaxed);
+                this->events_[count & this->mask] = trace_event{begin, end, kind, arg};
+                this->count.store(count + 1, std::memory_order_release);
+            }
+
+            // oldest first
+            std::vector<trace_event> events() const {
+                auto count = this->count.load(std::memory_order_acquire);
+                auto size = this->events_.size();
+                auto first = count > size ? count - size : 0;
+                std::vector<trace_event> result;
+                result.reserve(count - first);
+                for (auto i = first; i < count; i++) {
+                    result.push_back(this->events_[i & this->mask]);
+                }
+                return result;
+            }
+
+            // events lost because the ring wrapped around
+            std::uint64_t overwritten() const {
+                auto count = this->count.load(std::memory_order_acquire);
+                return count > this->events_.size() ? count - this->events_.size() : 0;
+            }
+
+            void clear() {
+                this->count.store(0, std::memory_order_relaxed);
+            }
+
+        private:
+            std::vector<trace_event> events_;
+            std::size_t mask;
+            std::atomic<std::uint64_t> count{0};
+    };
+
+    const char *trace_name(trace_kind kind) {
+        switch (kind) {
+            case trace_kind::task: return "task";
+            case trace_kind::drop: return "drop";
+            case trace_kind::steal: return "steal";
+            case trace_kind::park: return "park";
+        }
+        return "unknown";
+    }
+
+    // one Chrome trace event (chrome://tracing, ui.perfetto.dev),
+    // ts and dur are in microseconds relative to epoch
+    void write_trace_event(std::ostream &out, const trace_event &event,
+                           int pid, int tid, std::uint64_t epoch) {
+        auto begin = event.begin > epoch ? event.begin - epoch : 0;
+        auto end = event.end > epoch ? event.end - epoch : 0;
+        out << "{\"name\":\"" << trace_name(event.kind) << "\",\"cat\":\"pool\""
+            << ",\"pid\":" << pid << ",\"tid\":" << tid
+            << ",\"ts\":" << begin / 1000 << "." << begin / 100 % 10 << begin / 10 % 10 << begin % 10;
+        if (event.kind == trace_kind::task || event.kind == trace_kind::park) {
+            auto dur = end > begin ? end - begin : 0;
+            out << ",\"ph\":\"X\",\"dur\":" << dur / 1000 << "."
+                << dur / 100 % 10 << dur / 10 % 10 << dur % 10;
+        } else {
+            out << ",\"ph\":\"i\",\"s\":\"t\"";
+        }
+        if (event.kind == trace_kind::park) {
+            out << ",\"args\":{\"signaled\":" << event.arg << "}}";
+        } else {
+            out << ",\"args\":{\"stream\":" << event.arg << "}}";
+        }
+    }
+
+}
+
+#endif // __HPC_TRACE_HPP__